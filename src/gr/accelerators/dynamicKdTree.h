@@ -0,0 +1,276 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _OPENGR_ACCELERATORS_DYNAMIC_KDTREE_H
+#define _OPENGR_ACCELERATORS_DYNAMIC_KDTREE_H
+
+#include "gr/accelerators/kdtree.h"
+
+#include <vector>
+
+// number of points inserted before being indexed by a KdTree
+#define KD_DYNAMIC_BUFFER_SIZE 1024
+
+namespace gr{
+
+/*!
+  \brief 3D Kdtree supporting insertions, with the queries of KdTree
+
+  The points are stored in a logarithmic forest of static KdTrees: the i-th
+  tree is either empty or indexes bufferSize*2^i points. The last inserted
+  points are kept in a buffer scanned linearly. When the buffer is full, it
+  is merged with the smallest trees into the first empty slot, so that the
+  insertion of a point costs O(log(n)) amortized, instead of rebuilding the
+  whole tree.
+
+  Indices are given in insertion order. Each tree indexes a contiguous range
+  of indices, the largest trees storing the oldest points.
+  */
+template<typename _Scalar, typename _Index = int >
+class DynamicKdTree
+{
+public:
+    typedef _Scalar Scalar;
+    typedef _Index  Index;
+
+    typedef KdTree<Scalar, Index>            TreeType;
+    typedef typename TreeType::VectorType    VectorType;
+    typedef typename TreeType::PointList     PointList;
+    typedef typename TreeType::SizeType      SizeType;
+
+    template <int _stackSize = 64>
+    using RangeQuery = typename TreeType::template RangeQuery<_stackSize>;
+
+    static constexpr Index invalidIndex() { return TreeType::invalidIndex(); }
+
+    inline DynamicKdTree(unsigned int bufferSize = KD_DYNAMIC_BUFFER_SIZE)
+        : mBufferSize(bufferSize), mBufferBegin(0) {
+        mBuffer.reserve(bufferSize);
+    }
+
+    //! Add a new vertex, immediately available to the queries
+    template <class VectorDerived>
+    inline void add( const VectorDerived &p ){
+        mBuffer.push_back(p);
+        if (mBuffer.size() == mBufferSize)
+            mergeBuffer();
+    }
+
+    //! Number of points stored in the tree
+    inline SizeType size() const { return mBufferBegin + mBuffer.size(); }
+
+    /*!
+     * \brief Performs distance query and return indices
+     */
+    template<int stackSize, typename IndexContainer = std::vector<Index> >
+    inline void
+    doQueryDistIndices(RangeQuery<stackSize>& query,
+                       IndexContainer& result) const {
+        doQueryDistProcessIndices(query, [&result](Index i){
+            result.push_back(i);
+        });
+    }
+
+    /*!
+     * \brief Performs distance query and pass the indices to a functor
+     */
+    template<int stackSize, typename Functor>
+    inline void
+    doQueryDistProcessIndices(RangeQuery<stackSize> &query,
+                              Functor f) const;
+
+    /*!
+     * \brief Finds the closest element index within the range [0:sqrt(sqdist)]
+     * \param currentId Index of the querypoint if it belongs to the tree
+     * \see KdTree::doQueryRestrictedClosestIndex
+     */
+    template<int stackSize>
+    inline std::pair<Index, Scalar>
+    doQueryRestrictedClosestIndex(RangeQuery<stackSize> &query,
+                                  Index currentId = -1) const;
+
+    /*!
+     * \brief Finds the k closest elements within the range [0:sqrt(sqdist)]
+     * \see KdTree::doQueryKNearestIndices
+     */
+    template<int k, int stackSize>
+    inline int
+    doQueryKNearestIndices(RangeQuery<stackSize> &query,
+                           Index* indices,
+                           Scalar* sqdists,
+                           Index currentId = -1) const;
+
+private:
+    struct Level
+    {
+        TreeType tree;
+        //! Index of the first point of the tree
+        Index begin = 0;
+
+        inline bool empty() const { return tree.size() == 0; }
+        //! Converts an index of the forest to an index of the tree
+        inline Index local(Index id) const {
+            return (id >= begin && id < begin + Index(tree.size())) ? id - begin : Index(-1);
+        }
+    };
+
+    //! Builds a tree with the buffer and the trees smaller than the first
+    //! empty slot, and stores it in this slot.
+    inline void mergeBuffer();
+
+    unsigned int mBufferSize;
+    //! Index of the first point of the buffer
+    SizeType mBufferBegin;
+    PointList mBuffer;
+    std::vector<Level> mLevels;
+
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+
+template<typename Scalar, typename Index>
+void
+DynamicKdTree<Scalar, Index>::mergeBuffer()
+{
+    // the trees below the first empty slot are all used
+    unsigned int slot = 0;
+    while (slot != mLevels.size() && ! mLevels[slot].empty())
+        ++slot;
+    if (slot == mLevels.size())
+        mLevels.emplace_back();
+
+    const SizeType count = SizeType(mBufferSize) << slot;
+    TreeType tree (count);
+
+    // add the points in insertion order: oldest trees first, then the buffer
+    PointList points;
+    for (unsigned int i = slot; i-- != 0; ) {
+        const TreeType& level = mLevels[i].tree;
+        points.resize(level.size());
+        for (SizeType j = 0; j != level.size(); ++j)
+            points[level._getIndices()[j]] = level._getPoint(j);
+        for (const auto& p : points)
+            tree.add(p);
+        mLevels[i] = Level();
+    }
+    for (const auto& p : mBuffer)
+        tree.add(p);
+    tree.finalize();
+
+    mLevels[slot].tree  = std::move(tree);
+    mLevels[slot].begin = Index(mBufferBegin + mBuffer.size() - count);
+    mBufferBegin += mBuffer.size();
+    mBuffer.clear();
+}
+
+template<typename Scalar, typename Index>
+template<int stackSize, typename Functor>
+void
+DynamicKdTree<Scalar, Index>::doQueryDistProcessIndices(
+        RangeQuery<stackSize>& query,
+        Functor f) const
+{
+    for (const Level& level : mLevels) {
+        if (level.empty()) continue;
+        const Index begin = level.begin;
+        level.tree.doQueryDistProcessIndices(query, [&f, begin](Index i){
+            f(begin + i);
+        });
+    }
+    for (SizeType i = 0; i != mBuffer.size(); ++i)
+        if ((mBuffer[i] - query.queryPoint).squaredNorm() < query.sqdist)
+            f(Index(mBufferBegin + i));
+}
+
+/*!
+  The trees are queried one after the other, the search radius being shrunk
+  to the closest point found so far.
+  */
+template<typename Scalar, typename Index>
+template<int stackSize>
+std::pair<Index, Scalar>
+DynamicKdTree<Scalar, Index>::doQueryRestrictedClosestIndex(
+        RangeQuery<stackSize>& query,
+        Index currentId) const
+{
+    Index  cl_id   = invalidIndex();
+    Scalar cl_dist = query.sqdist;
+
+    for (const Level& level : mLevels) {
+        if (level.empty()) continue;
+        RangeQuery<stackSize> levelQuery;
+        levelQuery.queryPoint = query.queryPoint;
+        levelQuery.sqdist     = cl_dist;
+        auto res = level.tree.doQueryRestrictedClosestIndex(levelQuery, level.local(currentId));
+        if (res.first != invalidIndex()) {
+            cl_id   = level.begin + res.first;
+            cl_dist = res.second;
+        }
+    }
+    for (SizeType i = 0; i != mBuffer.size(); ++i) {
+        const Index id = Index(mBufferBegin + i);
+        const Scalar d = (mBuffer[i] - query.queryPoint).squaredNorm();
+        if (d <= cl_dist && id != currentId) {
+            cl_dist = d;
+            cl_id   = id;
+        }
+    }
+    return std::make_pair(cl_id, cl_dist);
+}
+
+template<typename Scalar, typename Index>
+template<int k, int stackSize>
+int
+DynamicKdTree<Scalar, Index>::doQueryKNearestIndices(
+        RangeQuery<stackSize>& query,
+        Index* indices,
+        Scalar* sqdists,
+        Index currentId) const
+{
+    typename TreeType::template KNearestHeap<k> heap;
+    Index  levelIndices[k];
+    Scalar levelSqdists[k];
+
+    for (const Level& level : mLevels) {
+        if (level.empty()) continue;
+        RangeQuery<stackSize> levelQuery;
+        levelQuery.queryPoint = query.queryPoint;
+        levelQuery.sqdist     = heap.bound(query.sqdist);
+        const int n = level.tree.template doQueryKNearestIndices<k>(
+                    levelQuery, levelIndices, levelSqdists, level.local(currentId));
+        for (int i = 0; i != n; ++i)
+            if (levelSqdists[i] <= heap.bound(query.sqdist))
+                heap.push(levelSqdists[i], level.begin + levelIndices[i]);
+    }
+    for (SizeType i = 0; i != mBuffer.size(); ++i) {
+        const Index id = Index(mBufferBegin + i);
+        const Scalar d = (mBuffer[i] - query.queryPoint).squaredNorm();
+        if (d <= heap.bound(query.sqdist) && id != currentId)
+            heap.push(d, id);
+    }
+
+    heap.sort();
+    for (int i = 0; i != heap.size; ++i){
+        indices[i] = heap.entries[i].id;
+        sqdists[i] = heap.entries[i].sq;
+    }
+    for (int i = heap.size; i != k; ++i){
+        indices[i] = invalidIndex();
+        sqdists[i] = query.sqdist;
+    }
+    return heap.size;
+}
+
+} //namespace gr
+
+#endif // _OPENGR_ACCELERATORS_DYNAMIC_KDTREE_H
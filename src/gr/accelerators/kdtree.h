@@ -48,13 +48,27 @@
 #define _OPENGR_ACCELERATORS_KDTREE_H
 
 #include "gr/utils/disablewarnings.h"
+#include "gr/utils/timer.h"
 
 #include <Eigen/Core>
 #include <Eigen/Geometry>
+#include <Eigen/StdVector>
 
+#include <vector>
+#include <algorithm>
 #include <limits>
+#include <stdexcept>
 #include <iostream>
 #include <numeric>  //iota
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+
+#ifdef OpenGR_USE_OPENMP
+#include <omp.h>
+#endif
 
 // max depth of the tree
 #define KD_MAX_DEPTH 32
@@ -62,18 +76,34 @@
 // number of neighbors
 #define KD_POINT_PER_CELL 64
 
+// minimum number of points of a subtree built by a dedicated task
+#define KD_PARALLEL_BUILD_SIZE 16384
+
+// version of the KdTree snapshot files, to be increased when the layout changes
+#define KD_SNAPSHOT_VERSION 1
+
 
 namespace gr{
 
 /*!
   \brief 3D Kdtree with reentrant queries
+
+  By default, the nodes are packed in 8 bytes, which limits the tree to 2^24
+  nodes and 2^32 points, leaves to 65535 points, and stores the split values
+  as float. Wide nodes lift these limits, and are used when _WideNodes is set
+  or when _Index is a 64 bits type.
   */
-template<typename _Scalar, typename _Index = int >
+template<typename _Scalar, typename _Index = int, bool _WideNodes = (sizeof(_Index) > 4) >
 class KdTree
 {
 public:
-    struct KdNode
+    typedef _Scalar Scalar;
+    typedef _Index  Index;
+
+    //! Node packed in 8 bytes
+    struct CompactKdNode
     {
+        typedef unsigned int SizeType;
         union {
             struct {
                 float splitValue;
@@ -88,8 +118,27 @@ public:
         };
     };
 
-    typedef _Scalar Scalar;
-    typedef _Index  Index;
+    //! Node with full precision split values and 64 bits node and point ids
+    struct WideKdNode
+    {
+        typedef std::uint64_t SizeType;
+        union {
+            struct {
+                Scalar   splitValue;
+                SizeType firstChildId;
+            };
+            struct {
+                SizeType start;
+                SizeType size;
+            };
+        };
+        unsigned char dim;
+        unsigned char leaf;
+    };
+
+    typedef typename std::conditional<_WideNodes, WideKdNode, CompactKdNode>::type KdNode;
+    //! Type used to store node ids and point offsets
+    typedef typename KdNode::SizeType SizeType;
 
     static constexpr Index invalidIndex() { return -1; }
 
@@ -99,14 +148,19 @@ public:
     typedef std::vector<KdNode>      NodeList;
     typedef std::vector<VectorType>  PointList;
     typedef std::vector<Index>       IndexList;
+    typedef std::vector<Scalar, Eigen::aligned_allocator<Scalar> > CoordinateList;
+
+    //! Number of points of a leaf processed at once by the queries
+    enum { LeafBatchSize = KD_POINT_PER_CELL };
+    typedef Eigen::Array<Scalar, Eigen::Dynamic, 1, Eigen::ColMajor, LeafBatchSize, 1> LeafDistances;
 
     //! element of the stack
     struct QueryNode
     {
         inline QueryNode() {}
-        inline QueryNode(unsigned int id) : nodeId(id) {}
+        inline QueryNode(SizeType id) : nodeId(id) {}
         //! id of the next node
-        unsigned int nodeId;
+        SizeType nodeId;
         //! squared distance to the next node
         Scalar sq;
     };
@@ -114,14 +168,90 @@ public:
     template <int _stackSize = 64>
     struct RangeQuery
     {
+        enum { stackSize = _stackSize };
         VectorType queryPoint;
         Scalar     sqdist;
         QueryNode  nodeStack[_stackSize];
     };
 
-    inline const NodeList&   _getNodes   (void) { return mNodes;   }
-    inline const PointList&  _getPoints  (void) { return mPoints;  }
-    inline const PointList&  _getIndices (void) { return mIndices;  }
+    /*!
+      Fixed capacity max-heap storing the _k closest neighbors found by a
+      query. The farthest neighbor is at the top of the heap.
+      */
+    template <int _k>
+    struct KNearestHeap
+    {
+        struct Entry
+        {
+            Scalar sq;
+            Index  id;
+            inline bool operator< (const Entry& other) const { return sq < other.sq; }
+        };
+
+        Entry entries[_k] {};
+        int   size = 0;
+
+        inline bool full() const { return size == _k; }
+
+        //! Squared distance a point must not exceed to enter the heap
+        inline Scalar bound(Scalar sqdist) const { return full() ? entries[0].sq : sqdist; }
+
+        //! Adds a neighbor, replacing the farthest one when the heap is full
+        inline void push(Scalar sq, Index id) {
+            const Entry entry = {sq, id};
+            if (_k == 1) { // closest neighbor only
+                entries[0] = entry;
+                size = 1;
+            }
+            else if (full())
+                siftDown(entry, size);
+            else {
+                // sift up the new entry from the bottom
+                int i = size++;
+                for (int p = (i-1)/2; i > 0 && entries[p] < entry; i = p, p = (i-1)/2)
+                    entries[i] = entries[p];
+                entries[i] = entry;
+            }
+        }
+
+        //! Sorts the entries by increasing distance, the heap being destroyed
+        inline void sort() {
+            if (_k == 1) return;
+            for (int n = size-1; n > 0; --n) {
+                const Entry entry = entries[n];
+                entries[n] = entries[0];
+                siftDown(entry, n);
+            }
+        }
+
+    private:
+        //! Replaces the top of the heap entries[0..n[ by entry
+        inline void siftDown(const Entry& entry, int n) {
+            int i = 0;
+            for (int c = 1; c < n; i = c, c = 2*c+1) {
+                if (c+1 < n && entries[c] < entries[c+1]) ++c;
+                if (! (entry < entries[c])) break;
+                entries[i] = entries[c];
+            }
+            entries[i] = entry;
+        }
+    };
+
+    //! Parameters controlling the shape of the tree
+    struct BuildParameters
+    {
+        //! Maximum number of points in a leaf
+        unsigned int nofPointsPerCell = KD_POINT_PER_CELL;
+        //! Maximum depth of the tree
+        unsigned int maxDepth = KD_MAX_DEPTH;
+    };
+
+    inline const NodeList&   _getNodes   (void) const { return mNodes;   }
+    inline const IndexList&  _getIndices (void) const { return mIndices;  }
+    //! Coordinates of the i-th point of the tree, in the order of the leaves
+    inline VectorType _getPoint(SizeType i) const {
+        return VectorType(mCoordinatesData[0][i], mCoordinatesData[1][i], mCoordinatesData[2][i]);
+    }
 
 
 public:
@@ -131,13 +261,40 @@ public:
            unsigned int maxDepth = KD_MAX_DEPTH );
 
     //! Create a void KdTree
-    KdTree( unsigned int size = 0,
+    KdTree( SizeType size = 0,
             unsigned int nofPointsPerCell = KD_POINT_PER_CELL,
             unsigned int maxDepth = KD_MAX_DEPTH );
 
+    //! Create a void KdTree using the given build parameters
+    KdTree( SizeType size, const BuildParameters& parameters )
+        : KdTree(size, parameters.nofPointsPerCell, parameters.maxDepth) {}
+
+    /*!
+     * \brief Selects the leaf size giving the fastest queries on points
+     *
+     * A tree is built with each candidate leaf size, and timed on closest
+     * point queries within sqrt(sqdist) of nbQueries of the points, as done
+     * to compute the LCP. The calibration costs one build per candidate, and
+     * is worth it for large trees queried many times.
+     */
+    static inline BuildParameters
+    calibrate(const PointList& points,
+              Scalar sqdist,
+              unsigned int nbQueries = 1000,
+              const std::vector<unsigned int>& leafSizes = {16, 32, 64, 128, 256});
+
+    //! Parameters used to build the tree
+    inline BuildParameters buildParameters() const {
+        BuildParameters parameters;
+        parameters.nofPointsPerCell = _nofPointsPerCell;
+        parameters.maxDepth         = _maxDepth;
+        return parameters;
+    }
+
     //! Add a new vertex in the KdTree
     template <class VectorDerived>
     inline void add( const VectorDerived &p ){
+        if (mPoints.size() != mIndices.size()) _restorePoints();
          // this is ok since the memory has been reserved at construction time
         mPoints.push_back(p);
         mIndices.push_back(mIndices.size());
@@ -149,13 +306,77 @@ public:
     }
 
     //! Finalize the creation of the KdTree
+    //! \param nbThreads Number of threads used to build the tree, 0 to use the
+    //! default number of OpenMP threads. The subtrees are built in parallel
+    //! only when they contain at least KD_PARALLEL_BUILD_SIZE points, and the
+    //! tree is the same whatever the number of threads.
+    //! \throw std::length_error when the tree does not fit in the compact
+    //! nodes: more than 2^24 nodes, or a leaf of more than 65535 points, which
+    //! happens with large leaf sizes or when maxDepth is reached. Use
+    //! WideNodes for such trees.
     inline
-    void finalize( );
+    void finalize( int nbThreads = 0 );
+
+    /*!
+     * \brief Reorders the nodes and the points to improve the cache locality
+     * of the queries
+     *
+     * Optional step after finalize(). The sibling pairs are stored in van
+     * Emde Boas order, so that any subtree of height h spans O(2^h) nodes
+     * stored contiguously, and the points of the leaves are stored in the
+     * order of the leaves. The queries return the same results, but fetch
+     * fewer cache lines on large trees.
+     */
+    inline void relayout();
 
     inline const AxisAlignedBoxType& aabb() const  {return mAABB; }
 
+    //! Number of points stored in the tree
+    inline SizeType size() const { return mNbPoints; }
+
+    KdTree(const KdTree& other) { *this = other; }
+    KdTree(KdTree&& other) { *this = std::move(other); }
+    inline KdTree& operator=(const KdTree& other);
+    inline KdTree& operator=(KdTree&& other);
+
     ~KdTree();
 
+    /*!
+     * \brief Writes the finalized tree to a snapshot file
+     *
+     * The snapshot stores the nodes, the reordered points, their indices and
+     * the bounding box in a flat binary layout, so that it can be memory
+     * mapped and queried in place (see attach()). It can only be read on
+     * platforms with the same endianness and by KdTrees of the same type.
+     *
+     * \return false if the file cannot be written
+     */
+    inline bool save(const std::string& filename) const;
+
+    /*!
+     * \brief Reads a snapshot written by save(), copying its content
+     * \return false if the file cannot be read or is not compatible
+     */
+    inline bool load(const std::string& filename);
+
+    /*!
+     * \brief Queries a snapshot stored in memory, without copying it
+     *
+     * Typically used with a memory mapped file (see Utils::MappedFile), so
+     * that the tree is available without being rebuilt nor deserialized,
+     * and that processes using the same snapshot share its memory pages.
+     * The memory must stay valid while the tree is used, and no point can be
+     * added to the tree.
+     *
+     * The nodes and indices are checked so that a truncated or corrupted
+     * snapshot cannot make the queries read out of the arrays, which costs
+     * a pass over the nodes and indices. The depth of the tree is bounded so
+     * that the queries fit in the stack of a default RangeQuery.
+     *
+     * \return false if the data is not a compatible snapshot
+     */
+    inline bool attach(const void* data, std::size_t size);
+
     /*!
      * \brief Performs distance query and return vector coordinates
      */
@@ -163,8 +384,8 @@ public:
     inline void
     doQueryDist(RangeQuery<stackSize>& query,
                 Container& result) const {
-        _doQueryDistIndicesWithFunctor(query, [&result,this](unsigned int i){
-            result.push_back(mPoints[i]);
+        _doQueryDistIndicesWithFunctor(query, [&result,this](SizeType i){
+            result.push_back(_getPoint(i));
         });
     }
 
@@ -175,8 +396,8 @@ public:
     inline void
     doQueryDistIndices(RangeQuery<stackSize>& query,
                        IndexContainer& result) const {
-        _doQueryDistIndicesWithFunctor(query, [&result,this](unsigned int i){
-            result.push_back(mIndices[i]);
+        _doQueryDistIndicesWithFunctor(query, [&result,this](SizeType i){
+            result.push_back(mIndicesData[i]);
         });
     }
 
@@ -187,19 +408,83 @@ public:
     inline void
     doQueryDistProcessIndices(RangeQuery<stackSize> &query,
                               Functor f) const {
-        _doQueryDistIndicesWithFunctor(query, [f,this](unsigned int i){
-            f(mIndices[i]);
+        _doQueryDistIndicesWithFunctor(query, [f,this](SizeType i){
+            f(mIndicesData[i]);
         });
     }
 
     /*!
      * \brief Finds the closest element index within the range [0:sqrt(sqdist)]
      * \param currentId Index of the querypoint if it belongs to the tree
+     * \param epsilon Approximation factor: the distance to the returned
+     * element is at most (1+epsilon) times the distance to the closest one.
+     * The query is exact when epsilon is 0.
      */
     template<int stackSize>
     inline std::pair<Index, Scalar>
     doQueryRestrictedClosestIndex(RangeQuery<stackSize> &query,
-                                  int currentId = -1) const;
+                                  Index currentId = -1,
+                                  Scalar epsilon = 0) const;
+
+    /*!
+     * \brief Finds any element within the range [0:sqrt(sqdist)]
+     *
+     * The traversal stops at the first element found, so this query is
+     * faster than doQueryRestrictedClosestIndex when only the existence of a
+     * neighbor matters. It finds an element if and only if
+     * doQueryRestrictedClosestIndex does.
+     *
+     * \param currentId Index of the querypoint if it belongs to the tree
+     * \return Index of the element, or invalidIndex() if there is none
+     */
+    template<int stackSize>
+    inline Index
+    doQueryFirstHitIndex(RangeQuery<stackSize> &query,
+                         Index currentId = -1) const;
+
+    /*!
+     * \brief Finds the k closest elements within the range [0:sqrt(sqdist)]
+     *
+     * The indices and squared distances of the neighbors are written to
+     * indices[0..k[ and sqdists[0..k[, sorted by increasing distance. The
+     * entries left when less than k neighbors are found are set to
+     * invalidIndex() and query.sqdist. No memory is allocated.
+     *
+     * \param currentId Index of the querypoint if it belongs to the tree
+     * \param epsilon Approximation factor, see doQueryRestrictedClosestIndex
+     * \return Number of neighbors found
+     */
+    template<int k, int stackSize>
+    inline int
+    doQueryKNearestIndices(RangeQuery<stackSize> &query,
+                           Index* indices,
+                           Scalar* sqdists,
+                           Index currentId = -1,
+                           Scalar epsilon = 0) const;
+
+    /*!
+     * \brief Performs doQueryKNearestIndices for a set of query points
+     *
+     * The results of the i-th query are written to indices[i*k..(i+1)*k[ and
+     * sqdists[i*k..(i+1)*k[.
+     *
+     * \param currentIds Optional array storing for each query the index of
+     * the query point if it belongs to the tree, -1 otherwise
+     * \param mortonOrder Process the queries along a Morton curve, so
+     * that consecutive queries traverse the same nodes. Recommended when the
+     * query points are not spatially coherent.
+     * \param epsilon Approximation factor, see doQueryRestrictedClosestIndex
+     */
+    template<int k>
+    inline void
+    doQueryKNearestIndicesBatch(const VectorType* queryPoints,
+                                SizeType nbQueries,
+                                Scalar sqdist,
+                                Index* indices,
+                                Scalar* sqdists,
+                                const Index* currentIds = nullptr,
+                                bool mortonOrder = false,
+                                Scalar epsilon = 0) const;
 
      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -211,14 +496,35 @@ protected:
       subset.
       */
     inline
-    unsigned int split(int start, int end, unsigned int dim, Scalar splitValue);
+    SizeType split(SizeType start, SizeType end, unsigned int dim, Scalar splitValue);
 
-    void createTree(unsigned int nodeId,
-                    unsigned int start,
-                    unsigned int end,
+    void createTree(NodeList& nodes,
+                    SizeType nodeId,
+                    SizeType start,
+                    SizeType end,
                     unsigned int level,
                     unsigned int targetCellsize,
-                    unsigned int targetMaxDepth);
+                    unsigned int targetMaxDepth,
+                    bool parallel);
+
+    /*!
+      Builds the subtree of the inner node covering [start..end[ in a
+      dedicated node list. The first element of the list is the node itself,
+      and is followed by its descendants.
+      */
+    void createSubtree(NodeList& nodes,
+                       SizeType start,
+                       SizeType end,
+                       unsigned int level,
+                       unsigned int targetCellsize,
+                       unsigned int targetMaxDepth,
+                       bool parallel);
+
+    /*!
+      Moves a subtree built by createSubtree to nodes[nodeId], its descendants
+      being appended to nodes.
+      */
+    static void mergeSubtree(NodeList& nodes, SizeType nodeId, const NodeList& subtree);
 
 
     /*!
@@ -228,12 +534,121 @@ protected:
     inline void
     _doQueryDistIndicesWithFunctor(RangeQuery<stackSize>& query,
                                    Functor f) const;
+
+    /*!
+     * \brief Computes the 30 bits Morton code of p, quantized in box
+     */
+    static inline unsigned int
+    _mortonCode(const VectorType& p, const AxisAlignedBoxType& box) {
+        unsigned int code = 0;
+        const VectorType extent = box.diagonal();
+        for (unsigned int d = 0; d != 3; ++d) {
+            Scalar t = extent[d] > Scalar(0) ? (p[d] - box.min()[d]) / extent[d] : Scalar(0);
+            unsigned int v = (unsigned int)(std::min(std::max(t, Scalar(0)), Scalar(1)) * Scalar(1023));
+            // spread the 10 bits of v every 3 bits
+            v = (v | (v << 16)) & 0x030000FF;
+            v = (v | (v <<  8)) & 0x0300F00F;
+            v = (v | (v <<  4)) & 0x030C30C3;
+            v = (v | (v <<  2)) & 0x09249249;
+            code |= v << d;
+        }
+        return code;
+    }
+
+    /*!
+     * \brief Computes the squared distances between p and the points
+     * [start..start+size[, with size <= LeafBatchSize
+     */
+    inline void
+    _computeLeafSquaredDistances(const VectorType& p,
+                                 SizeType start,
+                                 unsigned int size,
+                                 LeafDistances& distances) const {
+        typedef Eigen::Map<const Eigen::Array<Scalar, Eigen::Dynamic, 1> > CoordinateMap;
+        const CoordinateMap x (mCoordinatesData[0] + start, size);
+        const CoordinateMap y (mCoordinatesData[1] + start, size);
+        const CoordinateMap z (mCoordinatesData[2] + start, size);
+        // same evaluation order as VectorType::squaredNorm()
+        distances = (x - p.x()).square() + ((y - p.y()).square() + (z - p.z()).square());
+    }
+
+    //! Header of the snapshot files
+    struct SnapshotHeader
+    {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t byteOrder;
+        std::uint32_t scalarSize;
+        std::uint32_t indexSize;
+        std::uint32_t nodeSize;
+        std::uint32_t wideNodes;
+        std::uint32_t nofPointsPerCell;
+        std::uint32_t maxDepth;
+        std::uint64_t nbNodes;
+        std::uint64_t nbPoints;
+        double        aabbMin[3];
+        double        aabbMax[3];
+        //! offsets of the nodes, indices and coordinates arrays
+        std::uint64_t offsets[5];
+    };
+
+    //! Fills the header describing the snapshot of the tree
+    inline SnapshotHeader _snapshotHeader() const;
+
+    /*!
+     * \brief Checks that the nodes of a snapshot form a tree of at most
+     * maxDepth levels below the root, whose leaves cover valid ranges of
+     * points, and that the indices are in [0:nbPoints[
+     */
+    static inline bool _checkSnapshotArrays(const KdNode* nodes,
+                                            const Index* indices,
+                                            SizeType nbNodes,
+                                            SizeType nbPoints,
+                                            unsigned int maxDepth);
+
+    //! Makes the queries use the containers of the tree
+    inline void _useOwnData();
+
+    //! Copies the coordinates of the finalized tree back to mPoints, so that
+    //! the tree can be built again
+    inline void _restorePoints();
+
+    //! Computes the number of inner levels of the subtree of each node
+    inline unsigned int _computeHeights(SizeType nodeId, std::vector<unsigned int>& heights) const;
+
+    /*!
+     * \brief Lists in van Emde Boas order the inner nodes of the h first
+     * levels of the subtree of nodeId, each of them standing for its pair of
+     * children
+     */
+    inline void _vebOrder(SizeType nodeId, unsigned int h,
+                          const std::vector<unsigned int>& heights,
+                          std::vector<SizeType>& order) const;
+
+    //! Lists the nodes located depth levels below nodeId
+    inline void _collectNodes(SizeType nodeId, unsigned int depth,
+                              std::vector<SizeType>& nodes) const;
 protected:
 
+    //! Points given to add(), reordered during the construction. They are
+    //! released by finalize() once copied to mCoordinates.
     PointList  mPoints;
     IndexList  mIndices;
     AxisAlignedBoxType mAABB;
     NodeList   mNodes;
+    //! Coordinates of the points stored as structure of arrays (one array
+    //! per dimension), so the leaves can be scanned using SIMD instructions
+    CoordinateList mCoordinates[3];
+
+    //! Arrays read by the queries. They point either to the containers above
+    //! or to the memory given to attach().
+    SizeType          mNbPoints = 0;
+    SizeType          mNbNodes = 0;
+    const KdNode*     mNodesData = nullptr;
+    const Index*      mIndicesData = nullptr;
+    const Scalar*     mCoordinatesData[3] = {nullptr, nullptr, nullptr};
+    //! True when the arrays are owned by the caller of attach()
+    bool              mAttached = false;
 
     unsigned int _nofPointsPerCell;
     unsigned int _maxDepth;
@@ -244,10 +659,10 @@ protected:
 
 
 /*!
-  \see KdTree(unsigned int size, unsigned int nofPointsPerCell, unsigned int maxDepth)
+  \see KdTree(SizeType size, unsigned int nofPointsPerCell, unsigned int maxDepth)
   */
-template<typename Scalar, typename Index>
-KdTree<Scalar, Index>::KdTree(const PointList& points,
+template<typename Scalar, typename Index, bool WideNodes>
+KdTree<Scalar, Index, WideNodes>::KdTree(const PointList& points,
                        unsigned int nofPointsPerCell,
                        unsigned int maxDepth)
     : mPoints(points),
@@ -266,8 +681,8 @@ KdTree<Scalar, Index>::KdTree(const PointList& points,
 
   \see finalize()
   */
-template<typename Scalar, typename Index>
-KdTree<Scalar, Index>::KdTree(unsigned int size,
+template<typename Scalar, typename Index, bool WideNodes>
+KdTree<Scalar, Index, WideNodes>::KdTree(SizeType size,
                        unsigned int nofPointsPerCell,
                        unsigned int maxDepth)
     : _nofPointsPerCell(nofPointsPerCell),
@@ -277,10 +692,14 @@ KdTree<Scalar, Index>::KdTree(unsigned int size,
     mIndices.reserve(size);
 }
 
-template<typename Scalar, typename Index>
+template<typename Scalar, typename Index, bool WideNodes>
 void
-KdTree<Scalar, Index>::finalize()
+KdTree<Scalar, Index, WideNodes>::finalize(int nbThreads)
 {
+    if (mPoints.size() != mIndices.size()) _restorePoints();
+    if (mPoints.size() > std::numeric_limits<SizeType>::max())
+        throw std::length_error("[KdTree] too many points for the node type");
+
     mNodes.clear();
     mNodes.reserve(4*mPoints.size()/_nofPointsPerCell);
     mNodes.emplace_back();
@@ -288,14 +707,464 @@ KdTree<Scalar, Index>::finalize()
 #ifdef DEBUG
     std::cout << "create tree" << std::endl;
 #endif
-    createTree(0, 0, mPoints.size(), 1, _nofPointsPerCell, _maxDepth);
+#ifdef OpenGR_USE_OPENMP
+    if (nbThreads == 0) nbThreads = omp_get_max_threads();
+    if (nbThreads > 1 && mPoints.size() >= 2*KD_PARALLEL_BUILD_SIZE)
+    {
+#pragma omp parallel num_threads(nbThreads)
+#pragma omp single
+        createTree(mNodes, 0, 0, mPoints.size(), 1, _nofPointsPerCell, _maxDepth, true);
+    }
+    else
+#endif
+    createTree(mNodes, 0, 0, mPoints.size(), 1, _nofPointsPerCell, _maxDepth, false);
 #ifdef DEBUG
     std::cout << "create tree ... DONE (" << mPoints.size() << " points)" << std::endl;
 #endif
+
+    if (! WideNodes) {
+        // the compact nodes store the child ids on 24 bits and the leaf sizes
+        // on 16 bits, so an overflow truncates them: the leaves then no
+        // longer cover all the points
+        std::uint64_t nbLeafPoints = 0;
+        for (const KdNode& node : mNodes)
+            if (node.leaf) nbLeafPoints += node.size;
+        if (mNodes.size() > (std::size_t(1) << 24) || nbLeafPoints != mPoints.size()) {
+            mNodes.clear();
+            throw std::length_error("[KdTree] the tree does not fit in the compact nodes");
+        }
+    }
+
+    // the points of each leaf are now contiguous, and are only stored as
+    // structure of arrays
+    for (unsigned int d = 0; d != 3; ++d) {
+        mCoordinates[d].resize(mPoints.size());
+        for (SizeType i = 0; i != mPoints.size(); ++i)
+            mCoordinates[d][i] = mPoints[i][d];
+    }
+    PointList().swap(mPoints);
+    _useOwnData();
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+void
+KdTree<Scalar, Index, WideNodes>::_restorePoints()
+{
+    mPoints.resize(mCoordinates[0].size());
+    for (SizeType i = 0; i != mPoints.size(); ++i)
+        for (unsigned int d = 0; d != 3; ++d)
+            mPoints[i][d] = mCoordinates[d][i];
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+typename KdTree<Scalar, Index, WideNodes>::BuildParameters
+KdTree<Scalar, Index, WideNodes>::calibrate(const PointList& points,
+                                            Scalar sqdist,
+                                            unsigned int nbQueries,
+                                            const std::vector<unsigned int>& leafSizes)
+{
+    BuildParameters best;
+    if (points.empty() || nbQueries == 0) return best;
+
+    const SizeType step = std::max(SizeType(1), SizeType(points.size() / nbQueries));
+    double bestTime = std::numeric_limits<double>::max();
+    Index checksum = 0;
+
+    for (unsigned int leafSize : leafSizes) {
+        BuildParameters parameters;
+        parameters.nofPointsPerCell = leafSize;
+        KdTree tree (points.size(), parameters);
+        for (const auto& p : points)
+            tree.add(p);
+        tree.finalize();
+
+        Utils::Timer timer (true);
+        for (SizeType i = 0; i < points.size(); i += step) {
+            RangeQuery<> query;
+            query.queryPoint = points[i];
+            query.sqdist     = sqdist;
+            checksum += tree.doQueryRestrictedClosestIndex(query, Index(i)).first;
+        }
+        const double time = double(timer.elapsed().count());
+
+        if (time < bestTime) {
+            bestTime = time;
+            best     = parameters;
+        }
+    }
+
+    // keep the queries from being optimized away
+    volatile Index sink = checksum;
+    (void) sink;
+    return best;
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+void
+KdTree<Scalar, Index, WideNodes>::_useOwnData()
+{
+    mAttached    = false;
+    mNbPoints    = mIndices.size();
+    mNbNodes     = mNodes.size();
+    mNodesData   = mNodes.data();
+    mIndicesData = mIndices.data();
+    for (unsigned int d = 0; d != 3; ++d)
+        mCoordinatesData[d] = mCoordinates[d].data();
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+unsigned int
+KdTree<Scalar, Index, WideNodes>::_computeHeights(SizeType nodeId, std::vector<unsigned int>& heights) const
+{
+    const KdNode& node = mNodes[nodeId];
+    if (node.leaf) return heights[nodeId] = 0;
+    const SizeType childId = node.firstChildId;
+    return heights[nodeId] = 1 + std::max(_computeHeights(childId,   heights),
+                                          _computeHeights(childId+1, heights));
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+void
+KdTree<Scalar, Index, WideNodes>::_collectNodes(SizeType nodeId, unsigned int depth,
+                                                std::vector<SizeType>& nodes) const
+{
+    const KdNode& node = mNodes[nodeId];
+    if (depth == 0)
+        nodes.push_back(nodeId);
+    else if (! node.leaf) {
+        _collectNodes(node.firstChildId,   depth-1, nodes);
+        _collectNodes(node.firstChildId+1, depth-1, nodes);
+    }
+}
+
+/*!
+  The top half of the levels is laid out recursively, followed by each of the
+  subtrees rooted below it.
+  */
+template<typename Scalar, typename Index, bool WideNodes>
+void
+KdTree<Scalar, Index, WideNodes>::_vebOrder(SizeType nodeId, unsigned int h,
+                                            const std::vector<unsigned int>& heights,
+                                            std::vector<SizeType>& order) const
+{
+    h = std::min(h, heights[nodeId]);
+    if (h == 0) return;
+    if (h == 1) {
+        order.push_back(nodeId);
+        return;
+    }
+    const unsigned int top = h/2;
+    _vebOrder(nodeId, top, heights, order);
+
+    std::vector<SizeType> bottom;
+    _collectNodes(nodeId, top, bottom);
+    for (SizeType id : bottom)
+        _vebOrder(id, h-top, heights, order);
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+void
+KdTree<Scalar, Index, WideNodes>::relayout()
+{
+    if (mAttached || mNodes.empty()) return;
+
+    std::vector<unsigned int> heights (mNodes.size());
+    std::vector<SizeType> order;
+    order.reserve(mNodes.size()/2);
+    _vebOrder(0, _computeHeights(0, heights), heights, order);
+
+    // new position of the nodes, the root staying first
+    std::vector<SizeType> newIds (mNodes.size());
+    SizeType pos = 0;
+    newIds[0] = pos++;
+    for (SizeType id : order) {
+        newIds[mNodes[id].firstChildId]   = pos++;
+        newIds[mNodes[id].firstChildId+1] = pos++;
+    }
+
+    NodeList nodes (mNodes.size());
+    for (SizeType i = 0; i != mNodes.size(); ++i) {
+        KdNode& node = nodes[newIds[i]];
+        node = mNodes[i];
+        if (! node.leaf)
+            node.firstChildId = newIds[mNodes[i].firstChildId];
+    }
+
+    // store the points of the leaves in the order of the leaves
+    CoordinateList coordinates[3];
+    IndexList indices;
+    for (unsigned int d = 0; d != 3; ++d)
+        coordinates[d].reserve(mIndices.size());
+    indices.reserve(mIndices.size());
+    for (KdNode& node : nodes) {
+        if (! node.leaf) continue;
+        const SizeType start = node.start;
+        node.start = indices.size();
+        for (unsigned int d = 0; d != 3; ++d)
+            coordinates[d].insert(coordinates[d].end(),
+                                  mCoordinates[d].begin()+start,
+                                  mCoordinates[d].begin()+start+node.size);
+        indices.insert(indices.end(), mIndices.begin()+start, mIndices.begin()+start+node.size);
+    }
+
+    mNodes.swap(nodes);
+    mIndices.swap(indices);
+    for (unsigned int d = 0; d != 3; ++d)
+        mCoordinates[d].swap(coordinates[d]);
+    _useOwnData();
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+KdTree<Scalar, Index, WideNodes>&
+KdTree<Scalar, Index, WideNodes>::operator=(const KdTree& other)
+{
+    if (this == &other) return *this;
+    mPoints  = other.mPoints;
+    mIndices = other.mIndices;
+    mAABB    = other.mAABB;
+    mNodes   = other.mNodes;
+    for (unsigned int d = 0; d != 3; ++d)
+        mCoordinates[d] = other.mCoordinates[d];
+    _nofPointsPerCell = other._nofPointsPerCell;
+    _maxDepth         = other._maxDepth;
+    _useOwnData();
+    if (other.mAttached) {
+        mAttached    = true;
+        mNbPoints    = other.mNbPoints;
+        mNbNodes     = other.mNbNodes;
+        mNodesData   = other.mNodesData;
+        mIndicesData = other.mIndicesData;
+        for (unsigned int d = 0; d != 3; ++d)
+            mCoordinatesData[d] = other.mCoordinatesData[d];
+    }
+    return *this;
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+KdTree<Scalar, Index, WideNodes>&
+KdTree<Scalar, Index, WideNodes>::operator=(KdTree&& other)
+{
+    if (this == &other) return *this;
+    mPoints  = std::move(other.mPoints);
+    mIndices = std::move(other.mIndices);
+    mAABB    = other.mAABB;
+    mNodes   = std::move(other.mNodes);
+    for (unsigned int d = 0; d != 3; ++d)
+        mCoordinates[d] = std::move(other.mCoordinates[d]);
+    _nofPointsPerCell = other._nofPointsPerCell;
+    _maxDepth         = other._maxDepth;
+    _useOwnData();
+    if (other.mAttached) {
+        mAttached    = true;
+        mNbPoints    = other.mNbPoints;
+        mNbNodes     = other.mNbNodes;
+        mNodesData   = other.mNodesData;
+        mIndicesData = other.mIndicesData;
+        for (unsigned int d = 0; d != 3; ++d)
+            mCoordinatesData[d] = other.mCoordinatesData[d];
+    }
+    other._useOwnData();
+    return *this;
 }
 
-template<typename Scalar, typename Index>
-KdTree<Scalar, Index>::~KdTree()
+template<typename Scalar, typename Index, bool WideNodes>
+typename KdTree<Scalar, Index, WideNodes>::SnapshotHeader
+KdTree<Scalar, Index, WideNodes>::_snapshotHeader() const
+{
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(SnapshotHeader));
+    std::memcpy(header.magic, "OGRKDTRE", 8);
+    header.version          = KD_SNAPSHOT_VERSION;
+    header.byteOrder        = 0x01020304;
+    header.scalarSize       = sizeof(Scalar);
+    header.indexSize        = sizeof(Index);
+    header.nodeSize         = sizeof(KdNode);
+    header.wideNodes        = WideNodes;
+    header.nofPointsPerCell = _nofPointsPerCell;
+    header.maxDepth         = _maxDepth;
+    return header;
+}
+
+/*!
+  The arrays are stored after the header, in the order nodes, indices and
+  coordinates along each axis, each of them starting at a multiple of 64
+  bytes.
+  */
+template<typename Scalar, typename Index, bool WideNodes>
+bool
+KdTree<Scalar, Index, WideNodes>::save(const std::string& filename) const
+{
+    SnapshotHeader header = _snapshotHeader();
+    header.nbNodes  = mNbNodes;
+    header.nbPoints = mNbPoints;
+    for (unsigned int d = 0; d != 3; ++d) {
+        header.aabbMin[d] = mAABB.min()[d];
+        header.aabbMax[d] = mAABB.max()[d];
+    }
+
+    const void* arrays[5] = { mNodesData, mIndicesData,
+                              mCoordinatesData[0], mCoordinatesData[1], mCoordinatesData[2] };
+    const std::uint64_t sizes[5] = { header.nbNodes  * sizeof(KdNode),
+                                     header.nbPoints * sizeof(Index),
+                                     header.nbPoints * sizeof(Scalar),
+                                     header.nbPoints * sizeof(Scalar),
+                                     header.nbPoints * sizeof(Scalar) };
+    std::uint64_t offset = sizeof(SnapshotHeader);
+    for (unsigned int i = 0; i != 5; ++i) {
+        offset = (offset + 63) / 64 * 64;
+        header.offsets[i] = offset;
+        offset += sizes[i];
+    }
+
+    std::ofstream out (filename, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (! out) return false;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(SnapshotHeader));
+    const char padding[64] = {};
+    std::uint64_t written = sizeof(SnapshotHeader);
+    for (unsigned int i = 0; i != 5; ++i) {
+        out.write(padding, header.offsets[i] - written);
+        out.write(reinterpret_cast<const char*>(arrays[i]), sizes[i]);
+        written = header.offsets[i] + sizes[i];
+    }
+    return bool(out);
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+bool
+KdTree<Scalar, Index, WideNodes>::attach(const void* data, std::size_t size)
+{
+    if (data == nullptr || size < sizeof(SnapshotHeader)) return false;
+
+    SnapshotHeader header;
+    std::memcpy(&header, data, sizeof(SnapshotHeader));
+    const SnapshotHeader expected = _snapshotHeader();
+    if (std::memcmp(header.magic, expected.magic, 8) != 0 ||
+        header.version    != expected.version    ||
+        header.byteOrder  != expected.byteOrder  ||
+        header.scalarSize != expected.scalarSize ||
+        header.indexSize  != expected.indexSize  ||
+        header.nodeSize   != expected.nodeSize   ||
+        header.wideNodes  != expected.wideNodes  ||
+        header.nbNodes == 0 ||
+        // a query stacks at most one node per level, plus the root
+        header.maxDepth >= std::uint32_t(RangeQuery<>::stackSize) ||
+        header.nbNodes  > std::uint64_t(std::numeric_limits<SizeType>::max()) ||
+        header.nbPoints > std::uint64_t(std::numeric_limits<SizeType>::max()))
+        return false;
+
+    // the counts are compared to the available space instead of computing
+    // the sizes of the arrays, which may overflow
+    const std::uint64_t counts[5] = { header.nbNodes, header.nbPoints,
+                                      header.nbPoints, header.nbPoints, header.nbPoints };
+    const std::size_t elementSizes[5] = { sizeof(KdNode), sizeof(Index),
+                                          sizeof(Scalar), sizeof(Scalar), sizeof(Scalar) };
+    const std::size_t alignments[5] = { alignof(KdNode), alignof(Index),
+                                        alignof(Scalar), alignof(Scalar), alignof(Scalar) };
+    const char* bytes = static_cast<const char*>(data);
+    for (unsigned int i = 0; i != 5; ++i) {
+        if (header.offsets[i] > size ||
+            counts[i] > (size - header.offsets[i]) / elementSizes[i] ||
+            reinterpret_cast<std::uintptr_t>(bytes + header.offsets[i]) % alignments[i] != 0)
+            return false;
+    }
+
+    if (! _checkSnapshotArrays(reinterpret_cast<const KdNode*>(bytes + header.offsets[0]),
+                               reinterpret_cast<const Index*> (bytes + header.offsets[1]),
+                               SizeType(header.nbNodes), SizeType(header.nbPoints),
+                               header.maxDepth))
+        return false;
+
+    mPoints.clear();
+    mIndices.clear();
+    mNodes.clear();
+    for (unsigned int d = 0; d != 3; ++d)
+        mCoordinates[d].clear();
+
+    mAABB.setEmpty();
+    for (unsigned int d = 0; d != 3; ++d) {
+        mAABB.min()[d] = Scalar(header.aabbMin[d]);
+        mAABB.max()[d] = Scalar(header.aabbMax[d]);
+    }
+    _nofPointsPerCell = header.nofPointsPerCell;
+    _maxDepth         = header.maxDepth;
+
+    mAttached    = true;
+    mNbPoints    = header.nbPoints;
+    mNbNodes     = header.nbNodes;
+    mNodesData   = reinterpret_cast<const KdNode*>    (bytes + header.offsets[0]);
+    mIndicesData = reinterpret_cast<const Index*>     (bytes + header.offsets[1]);
+    for (unsigned int d = 0; d != 3; ++d)
+        mCoordinatesData[d] = reinterpret_cast<const Scalar*>(bytes + header.offsets[2+d]);
+    return true;
+}
+
+/*!
+  The children of a node are stored after it by the construction and by
+  relayout(), so the depths can be computed in a single pass, and this
+  ordering also prevents cycles.
+  */
+template<typename Scalar, typename Index, bool WideNodes>
+bool
+KdTree<Scalar, Index, WideNodes>::_checkSnapshotArrays(const KdNode* nodes,
+                                                       const Index* indices,
+                                                       SizeType nbNodes,
+                                                       SizeType nbPoints,
+                                                       unsigned int maxDepth)
+{
+    std::vector<unsigned int> depths (nbNodes, 0);
+    for (SizeType i = 0; i != nbNodes; ++i) {
+        const KdNode& node = nodes[i];
+        if (node.leaf) {
+            if (node.start > nbPoints || node.size > nbPoints - node.start)
+                return false;
+        }
+        else {
+            if (node.dim > 2 || node.firstChildId <= i ||
+                node.firstChildId >= nbNodes - 1 || depths[i] >= maxDepth)
+                return false;
+            const SizeType childId = node.firstChildId;
+            depths[childId]   = std::max(depths[childId],   depths[i] + 1);
+            depths[childId+1] = std::max(depths[childId+1], depths[i] + 1);
+        }
+    }
+    for (SizeType i = 0; i != nbPoints; ++i)
+        if (indices[i] < Index(0) || SizeType(indices[i]) >= nbPoints)
+            return false;
+    return true;
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+bool
+KdTree<Scalar, Index, WideNodes>::load(const std::string& filename)
+{
+    std::ifstream in (filename, std::ios_base::in | std::ios_base::binary);
+    if (! in) return false;
+    in.seekg(0, std::ios_base::end);
+    const std::size_t size = std::size_t(in.tellg());
+    in.seekg(0, std::ios_base::beg);
+    // 64 bits elements, so that the arrays are aligned as in the file
+    std::vector<std::uint64_t> buffer ((size + 7) / 8);
+    if (! in.read(reinterpret_cast<char*>(buffer.data()), size)) return false;
+
+    KdTree snapshot;
+    if (! snapshot.attach(buffer.data(), size)) return false;
+
+    // copy the arrays referenced by the snapshot
+    mNodes.assign(snapshot.mNodesData, snapshot.mNodesData + snapshot.mNbNodes);
+    mPoints.clear();
+    mIndices.assign(snapshot.mIndicesData, snapshot.mIndicesData + snapshot.mNbPoints);
+    for (unsigned int d = 0; d != 3; ++d)
+        mCoordinates[d].assign(snapshot.mCoordinatesData[d],
+                               snapshot.mCoordinatesData[d] + snapshot.mNbPoints);
+    mAABB             = snapshot.mAABB;
+    _nofPointsPerCell = snapshot._nofPointsPerCell;
+    _maxDepth         = snapshot._maxDepth;
+    _useOwnData();
+    return true;
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+KdTree<Scalar, Index, WideNodes>::~KdTree()
 {
 }
 
@@ -315,17 +1184,23 @@ KdTree<Scalar, Index>::~KdTree()
 
   The optionnal parameter currentId is used when the query point is
   stored in the tree, and must thus be avoided during the query
+
+  With a non-zero epsilon, once an element has been found, the cells farther
+  than the current closest distance divided by (1+epsilon) are pruned.
 */
-template<typename Scalar, typename Index>
+template<typename Scalar, typename Index, bool WideNodes>
 template<int stackSize>
 std::pair<Index, Scalar>
-KdTree<Scalar, Index>::doQueryRestrictedClosestIndex(
+KdTree<Scalar, Index, WideNodes>::doQueryRestrictedClosestIndex(
         RangeQuery<stackSize>& query,
-        int currentId) const
+        Index currentId,
+        Scalar epsilon) const
 {
 
     Index  cl_id   = invalidIndex();
     Scalar cl_dist = query.sqdist;
+    LeafDistances distances;
+    const Scalar pruneFactor = (Scalar(1) + epsilon) * (Scalar(1) + epsilon);
 
     query.nodeStack[0].nodeId = 0;
     query.nodeStack[0].sq = 0.f;
@@ -336,19 +1211,24 @@ KdTree<Scalar, Index>::doQueryRestrictedClosestIndex(
     {
         //nbLoop++;
         QueryNode&    qnode = query.nodeStack[count-1];
-        const KdNode& node  = mNodes[qnode.nodeId];
+        const KdNode& node  = mNodesData[qnode.nodeId];
 
-        if (qnode.sq < cl_dist)
+        if (qnode.sq * (cl_id == invalidIndex() ? Scalar(1) : pruneFactor) < cl_dist)
         {
             if (node.leaf)
             {
                 --count; // pop
-                const int end = node.start+node.size;
-                for (int i=node.start ; i<end ; ++i){
-                    const Scalar sqdist = (query.queryPoint - mPoints[i]).squaredNorm();
-                    if (sqdist <= cl_dist && mIndices[i] != currentId){
-                        cl_dist = sqdist;
-                        cl_id   = mIndices[i];
+                const SizeType end = node.start+node.size;
+                for (SizeType start=node.start ; start<end ; start+=LeafBatchSize){
+                    const unsigned int size = (unsigned int)(std::min(end-start, SizeType(LeafBatchSize)));
+                    _computeLeafSquaredDistances(query.queryPoint, start, size, distances);
+                    // skip the batch if no point is closer than the current one
+                    if (distances.minCoeff() > cl_dist) continue;
+                    for (unsigned int j=0 ; j<size ; ++j){
+                        if (distances[j] <= cl_dist && mIndicesData[start+j] != currentId){
+                            cl_dist = distances[j];
+                            cl_id   = mIndicesData[start+j];
+                        }
                     }
                 }
             }
@@ -383,6 +1263,202 @@ KdTree<Scalar, Index>::doQueryRestrictedClosestIndex(
     return std::make_pair(cl_id, cl_dist);
 }
 
+/*!
+  \see doQueryRestrictedClosestIndex For more information about the algorithm.
+
+  The cells are pruned using the query radius, which never shrinks, so any
+  element found by doQueryRestrictedClosestIndex lies in a visited cell.
+ */
+template<typename Scalar, typename Index, bool WideNodes>
+template<int stackSize>
+Index
+KdTree<Scalar, Index, WideNodes>::doQueryFirstHitIndex(
+        RangeQuery<stackSize>& query,
+        Index currentId) const
+{
+    LeafDistances distances;
+
+    query.nodeStack[0].nodeId = 0;
+    query.nodeStack[0].sq = 0.f;
+    unsigned int count = 1;
+
+    while (count)
+    {
+        QueryNode&    qnode = query.nodeStack[count-1];
+        const KdNode& node  = mNodesData[qnode.nodeId];
+
+        if (qnode.sq < query.sqdist)
+        {
+            if (node.leaf)
+            {
+                --count; // pop
+                const SizeType end = node.start+node.size;
+                for (SizeType start=node.start ; start<end ; start+=LeafBatchSize){
+                    const unsigned int size = (unsigned int)(std::min(end-start, SizeType(LeafBatchSize)));
+                    _computeLeafSquaredDistances(query.queryPoint, start, size, distances);
+                    if (distances.minCoeff() > query.sqdist) continue;
+                    for (unsigned int j=0 ; j<size ; ++j){
+                        if (distances[j] <= query.sqdist && mIndicesData[start+j] != currentId)
+                            return mIndicesData[start+j];
+                    }
+                }
+            }
+            else
+            {
+                // replace the stack top by the farthest and push the closest
+                const Scalar new_off = query.queryPoint[node.dim] - node.splitValue;
+                if (new_off < 0.)
+                {
+                    query.nodeStack[count].nodeId  = node.firstChildId;
+                    qnode.nodeId = node.firstChildId+1;
+                }
+                else
+                {
+                    query.nodeStack[count].nodeId  = node.firstChildId+1;
+                    qnode.nodeId = node.firstChildId;
+                }
+                query.nodeStack[count].sq = qnode.sq;
+                qnode.sq = new_off*new_off;
+                ++count;
+            }
+        }
+        else
+        {
+            // pop
+            --count;
+        }
+    }
+    return invalidIndex();
+}
+
+/*!
+  \see doQueryRestrictedClosestIndex For more information about the algorithm.
+
+  The search radius is shrunk to the distance of the k-th neighbor as soon as
+  k neighbors have been found. With k=1, the result is the same as
+  doQueryRestrictedClosestIndex.
+ */
+template<typename Scalar, typename Index, bool WideNodes>
+template<int k, int stackSize>
+int
+KdTree<Scalar, Index, WideNodes>::doQueryKNearestIndices(
+        RangeQuery<stackSize>& query,
+        Index* indices,
+        Scalar* sqdists,
+        Index currentId,
+        Scalar epsilon) const
+{
+    static_assert(k > 0, "at least one neighbor must be requested");
+
+    KNearestHeap<k> heap;
+    LeafDistances distances;
+    const Scalar pruneFactor = (Scalar(1) + epsilon) * (Scalar(1) + epsilon);
+
+    query.nodeStack[0].nodeId = 0;
+    query.nodeStack[0].sq = 0.f;
+    unsigned int count = 1;
+
+    while (count)
+    {
+        QueryNode&    qnode = query.nodeStack[count-1];
+        const KdNode& node  = mNodesData[qnode.nodeId];
+
+        if (qnode.sq * (heap.full() ? pruneFactor : Scalar(1)) < heap.bound(query.sqdist))
+        {
+            if (node.leaf)
+            {
+                --count; // pop
+                const SizeType end = node.start+node.size;
+                for (SizeType start=node.start ; start<end ; start+=LeafBatchSize){
+                    const unsigned int size = (unsigned int)(std::min(end-start, SizeType(LeafBatchSize)));
+                    _computeLeafSquaredDistances(query.queryPoint, start, size, distances);
+                    if (distances.minCoeff() > heap.bound(query.sqdist)) continue;
+                    for (unsigned int j=0 ; j<size ; ++j){
+                        if (distances[j] <= heap.bound(query.sqdist) && mIndicesData[start+j] != currentId)
+                            heap.push(distances[j], mIndicesData[start+j]);
+                    }
+                }
+            }
+            else
+            {
+                // replace the stack top by the farthest and push the closest
+                const Scalar new_off = query.queryPoint[node.dim] - node.splitValue;
+                if (new_off < 0.)
+                {
+                    query.nodeStack[count].nodeId  = node.firstChildId;
+                    qnode.nodeId = node.firstChildId+1;
+                }
+                else
+                {
+                    query.nodeStack[count].nodeId  = node.firstChildId+1;
+                    qnode.nodeId = node.firstChildId;
+                }
+                query.nodeStack[count].sq = qnode.sq;
+                qnode.sq = new_off*new_off;
+                ++count;
+            }
+        }
+        else
+        {
+            // pop
+            --count;
+        }
+    }
+
+    heap.sort();
+    for (int i = 0; i != heap.size; ++i){
+        indices[i] = heap.entries[i].id;
+        sqdists[i] = heap.entries[i].sq;
+    }
+    for (int i = heap.size; i != k; ++i){
+        indices[i] = invalidIndex();
+        sqdists[i] = query.sqdist;
+    }
+    return heap.size;
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+template<int k>
+void
+KdTree<Scalar, Index, WideNodes>::doQueryKNearestIndicesBatch(
+        const VectorType* queryPoints,
+        SizeType nbQueries,
+        Scalar sqdist,
+        Index* indices,
+        Scalar* sqdists,
+        const Index* currentIds,
+        bool mortonOrder,
+        Scalar epsilon) const
+{
+    // order in which the queries are processed
+    std::vector<SizeType> order (nbQueries);
+    std::iota(order.begin(), order.end(), 0);
+    if (mortonOrder && nbQueries > 1) {
+        AxisAlignedBoxType box;
+        for (SizeType i = 0; i != nbQueries; ++i)
+            box.extend(queryPoints[i]);
+        std::vector<unsigned int> codes (nbQueries);
+        for (SizeType i = 0; i != nbQueries; ++i)
+            codes[i] = _mortonCode(queryPoints[i], box);
+        std::sort(order.begin(), order.end(), [&codes](SizeType a, SizeType b){
+            return codes[a] < codes[b];
+        });
+    }
+
+#ifdef OpenGR_USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (std::int64_t i = 0; i < std::int64_t(nbQueries); ++i) {
+        const SizeType q = order[i];
+        RangeQuery<> query;
+        query.queryPoint = queryPoints[q];
+        query.sqdist     = sqdist;
+        doQueryKNearestIndices<k>(query, indices + q*k, sqdists + q*k,
+                                  currentIds == nullptr ? -1 : currentIds[q],
+                                  epsilon);
+    }
+}
+
 /*!
   \see doQueryRestrictedClosestIndex For more information about the algorithm.
 
@@ -390,13 +1466,14 @@ KdTree<Scalar, Index>::doQueryRestrictedClosestIndex(
   that allow to perform the query by requesting a maximum distance instead of
   neighborhood size.
  */
-template<typename Scalar, typename Index>
+template<typename Scalar, typename Index, bool WideNodes>
 template<int stackSize, typename Functor >
 void
-KdTree<Scalar, Index>::_doQueryDistIndicesWithFunctor(
+KdTree<Scalar, Index, WideNodes>::_doQueryDistIndicesWithFunctor(
         RangeQuery<stackSize>& query,
         Functor f) const
 {
+    LeafDistances distances;
     query.nodeStack[0].nodeId = 0;
     query.nodeStack[0].sq = 0.f;
     unsigned int count = 1;
@@ -404,18 +1481,23 @@ KdTree<Scalar, Index>::_doQueryDistIndicesWithFunctor(
     while (count)
     {
         QueryNode&    qnode = query.nodeStack[count-1];
-        const KdNode & node = mNodes[qnode.nodeId];
+        const KdNode & node = mNodesData[qnode.nodeId];
 
         if (qnode.sq < query.sqdist)
         {
             if (node.leaf)
             {
                 --count; // pop
-                unsigned int end = node.start+node.size;
-                for (unsigned int i=node.start ; i<end ; ++i)
-                    if ( (query.queryPoint - mPoints[i]).squaredNorm() < query.sqdist){
-                        f(i);
-                    }
+                const SizeType end = node.start+node.size;
+                for (SizeType start=node.start ; start<end ; start+=LeafBatchSize){
+                    const unsigned int size = (unsigned int)(std::min(end-start, SizeType(LeafBatchSize)));
+                    _computeLeafSquaredDistances(query.queryPoint, start, size, distances);
+                    if (distances.minCoeff() >= query.sqdist) continue;
+                    for (unsigned int j=0 ; j<size ; ++j)
+                        if (distances[j] < query.sqdist){
+                            f(start+j);
+                        }
+                }
             }
             else
             {
@@ -444,15 +1526,18 @@ KdTree<Scalar, Index>::_doQueryDistIndicesWithFunctor(
     }
 }
 
-template<typename Scalar, typename Index>
-unsigned int KdTree<Scalar, Index>::split(int start, int end, unsigned int dim, Scalar splitValue)
+template<typename Scalar, typename Index, bool WideNodes>
+typename KdTree<Scalar, Index, WideNodes>::SizeType
+KdTree<Scalar, Index, WideNodes>::split(SizeType start, SizeType end, unsigned int dim, Scalar splitValue)
 {
-    int l(start), r(end-1);
+    typedef typename std::make_signed<SizeType>::type SignedSizeType;
+    const SignedSizeType first(start), last(end);
+    SignedSizeType l(first), r(last-1);
     for ( ; l<r ; ++l, --r)
     {
-        while (l < end && mPoints[l][dim] < splitValue)
+        while (l < last && mPoints[l][dim] < splitValue)
             l++;
-        while (r >= start && mPoints[r][dim] >= splitValue)
+        while (r >= first && mPoints[r][dim] >= splitValue)
             r--;
         if (l > r)
             break;
@@ -482,14 +1567,14 @@ unsigned int KdTree<Scalar, Index>::split(int start, int end, unsigned int dim,
    to prune only about 10% of the leaves, but the overhead of this pruning (ball/ABBB intersection)
    is more expensive than the gain it provides and the memory consumption is x4 higher !
 */
-template<typename Scalar, typename Index>
-void KdTree<Scalar, Index>::createTree(unsigned int nodeId, unsigned int start, unsigned int end, unsigned int level, unsigned int targetCellSize, unsigned int targetMaxDepth)
+template<typename Scalar, typename Index, bool WideNodes>
+void KdTree<Scalar, Index, WideNodes>::createTree(NodeList& nodes, SizeType nodeId, SizeType start, SizeType end, unsigned int level, unsigned int targetCellSize, unsigned int targetMaxDepth, bool parallel)
 {
 
-    KdNode& node = mNodes[nodeId];
+    KdNode& node = nodes[nodeId];
     AxisAlignedBoxType aabb;
     //aabb.Set(mPoints[start]);
-    for (unsigned int i=start ; i<end ; ++i)
+    for (SizeType i=start ; i<end ; ++i)
         aabb.extend(mPoints[i]);
 
     VectorType diag =  aabb.diagonal();
@@ -517,24 +1602,46 @@ void KdTree<Scalar, Index>::createTree(unsigned int nodeId, unsigned int start,
     node.dim = dim;
     node.splitValue = aabb.center()(dim);
 
-    unsigned int midId = split(start, end, dim, node.splitValue);
+    SizeType midId = split(start, end, dim, node.splitValue);
 
-    node.firstChildId = mNodes.size();
+    node.firstChildId = nodes.size();
 
     {
         KdNode n;
         n.size = 0;
-        mNodes.push_back(n);
-        mNodes.push_back(n);
+        nodes.push_back(n);
+        nodes.push_back(n);
     }
     //mNodes << Node() << Node();
     //mNodes.resize(mNodes.size()+2);
 
+    const bool leftLeaf  = midId-start <= targetCellSize || level>=targetMaxDepth;
+    const bool rightLeaf = end-midId   <= targetCellSize || level>=targetMaxDepth;
+
+#ifdef OpenGR_USE_OPENMP
+    // Build the two subtrees concurrently when they are large enough. The
+    // subtrees are stored in separate lists, and merged in the order used
+    // by the sequential construction.
+    if (parallel && !leftLeaf && !rightLeaf &&
+        midId-start >= KD_PARALLEL_BUILD_SIZE && end-midId >= KD_PARALLEL_BUILD_SIZE)
+    {
+        NodeList left, right;
+#pragma omp task shared(left)
+        createSubtree(left, start, midId, level+1, targetCellSize, targetMaxDepth, true);
+        createSubtree(right, midId, end, level+1, targetCellSize, targetMaxDepth, true);
+#pragma omp taskwait
+        const SizeType childId = nodes[nodeId].firstChildId;
+        mergeSubtree(nodes, childId,   left);
+        mergeSubtree(nodes, childId+1, right);
+        return;
+    }
+#endif
+
     {
         // left child
-        unsigned int childId = mNodes[nodeId].firstChildId;
-        KdNode& child = mNodes[childId];
-        if (midId-start <= targetCellSize || level>=targetMaxDepth)
+        SizeType childId = nodes[nodeId].firstChildId;
+        KdNode& child = nodes[childId];
+        if (leftLeaf)
         {
             child.leaf = 1;
             child.start = start;
@@ -543,15 +1650,15 @@ void KdTree<Scalar, Index>::createTree(unsigned int nodeId, unsigned int start,
         else
         {
             child.leaf = 0;
-            createTree(childId, start, midId, level+1, targetCellSize, targetMaxDepth);
+            createTree(nodes, childId, start, midId, level+1, targetCellSize, targetMaxDepth, parallel);
         }
     }
 
     {
         // right child
-        unsigned int childId = mNodes[nodeId].firstChildId+1;
-        KdNode& child = mNodes[childId];
-        if (end-midId <= targetCellSize || level>=targetMaxDepth)
+        SizeType childId = nodes[nodeId].firstChildId+1;
+        KdNode& child = nodes[childId];
+        if (rightLeaf)
         {
             child.leaf = 1;
             child.start = midId;
@@ -560,10 +1667,32 @@ void KdTree<Scalar, Index>::createTree(unsigned int nodeId, unsigned int start,
         else
         {
             child.leaf = 0;
-            createTree(childId, midId, end, level+1, targetCellSize, targetMaxDepth);
+            createTree(nodes, childId, midId, end, level+1, targetCellSize, targetMaxDepth, parallel);
         }
     }
 }
+
+template<typename Scalar, typename Index, bool WideNodes>
+void KdTree<Scalar, Index, WideNodes>::createSubtree(NodeList& nodes, SizeType start, SizeType end, unsigned int level, unsigned int targetCellSize, unsigned int targetMaxDepth, bool parallel)
+{
+    nodes.reserve(4*(end-start)/targetCellSize);
+    nodes.emplace_back();
+    nodes.back().leaf = 0;
+    createTree(nodes, 0, start, end, level, targetCellSize, targetMaxDepth, parallel);
+}
+
+template<typename Scalar, typename Index, bool WideNodes>
+void KdTree<Scalar, Index, WideNodes>::mergeSubtree(NodeList& nodes, SizeType nodeId, const NodeList& subtree)
+{
+    // the descendants are moved from subtree[1..] to nodes[offset..]
+    const SizeType offset = nodes.size();
+    nodes.insert(nodes.end(), subtree.begin()+1, subtree.end());
+    nodes[nodeId] = subtree.front();
+    nodes[nodeId].firstChildId = subtree.front().firstChildId + offset - 1;
+    for (SizeType i = offset; i != nodes.size(); ++i)
+        if (! nodes[i].leaf)
+            nodes[i].firstChildId = nodes[i].firstChildId + offset - 1;
+}
 } //namespace Super4PCS
 
 
@@ -0,0 +1,246 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _OPENGR_ACCELERATORS_OCCUPANCYGRID_H
+#define _OPENGR_ACCELERATORS_OCCUPANCYGRID_H
+
+#include <Eigen/Core>
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+namespace gr{
+
+/*!
+  \brief Sparse voxel grid storing, for each cell, whether a set of points
+  dilated by a distance threshold covers it.
+
+  Each cell is classified as:
+   - EMPTY: no point is within the threshold of any location of the cell,
+   - FULL: every location of the cell is within the threshold of a point,
+   - BORDER: the cell is partially covered, and an exact query is required.
+
+  Only the non-empty cells are stored, in an open-addressing hash table.
+  Query are thus O(1), and do not require any allocation.
+  */
+template<typename _Scalar>
+class OccupancyGrid
+{
+public:
+    typedef _Scalar Scalar;
+    typedef Eigen::Matrix<Scalar,3,1> VectorType;
+
+    enum CellState : std::uint8_t {
+        EMPTY  = 0,
+        BORDER = 1,
+        FULL   = 2
+    };
+
+    /// Ratio between the cell size and the dilation distance.
+    static constexpr Scalar kCellRatio = Scalar(0.5);
+
+    inline OccupancyGrid() : mCellSize(1), mInvCellSize(1), mMask(0) {}
+
+    /// Build the grid from a range of points (accessed through pos())
+    /// dilated by distance. The grid is left empty if the points span too
+    /// many cells to be indexed.
+    template <typename PointContainer>
+    inline void build(const PointContainer& points, Scalar distance);
+
+    inline void clear() {
+        mKeys.clear();
+        mStates.clear();
+        mMask = 0;
+    }
+
+    /// Returns true if the grid has not been built
+    inline bool empty() const { return mKeys.empty(); }
+
+    /// Number of non-empty cells
+    inline size_t size() const {
+        size_t n = 0;
+        for (const auto& s : mStates) if (s != EMPTY) ++n;
+        return n;
+    }
+
+    inline Scalar cellSize() const { return mCellSize; }
+
+    /// Get the state of the cell containing p
+    inline CellState classify(const VectorType& p) const {
+        if (mKeys.empty()) return EMPTY;
+        Eigen::Matrix<std::int64_t, 3, 1> c;
+        for (int d = 0; d != 3; ++d) {
+            c[d] = cellCoordinate(p[d]);
+            if (c[d] < mCellMin[d] || c[d] > mCellMax[d]) return EMPTY;
+        }
+        const std::uint64_t key = cellKey( c[0], c[1], c[2] );
+        for (size_t slot = hash(key) & mMask; ; slot = (slot + 1) & mMask) {
+            const CellState s = CellState(mStates[slot]);
+            if (s == EMPTY) return EMPTY;
+            if (mKeys[slot] == key) return s;
+        }
+    }
+
+private:
+    // Coordinates are packed on 21 bits per dimension
+    static constexpr int kCoordBits = 21;
+    static constexpr std::int64_t kCoordOffset = std::int64_t(1) << (kCoordBits-1);
+
+    inline std::int64_t cellCoordinate(Scalar x) const {
+        const Scalar c = std::floor(x * mInvCellSize);
+        // clamp to avoid overflows with points far away from the grid
+        if (c < -Scalar(kCoordOffset)) return -kCoordOffset - 1;
+        if (c >  Scalar(kCoordOffset)) return  kCoordOffset + 1;
+        return std::int64_t(c);
+    }
+
+    static inline std::uint64_t cellKey(std::int64_t x, std::int64_t y, std::int64_t z) {
+        const std::uint64_t mask = (std::uint64_t(1) << kCoordBits) - 1;
+        return  (std::uint64_t(x + kCoordOffset) & mask)
+             | ((std::uint64_t(y + kCoordOffset) & mask) << kCoordBits)
+             | ((std::uint64_t(z + kCoordOffset) & mask) << (2*kCoordBits));
+    }
+
+    static inline size_t hash(std::uint64_t key) {
+        // 64 bits finalizer from MurmurHash3
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb93fe1a85ec9ULL;
+        key ^= key >> 33;
+        return size_t(key);
+    }
+
+    /// Insert or upgrade the state of a cell. Returns true if a new cell has
+    /// been inserted
+    inline bool insert(std::uint64_t key, CellState state) {
+        for (size_t slot = hash(key) & mMask; ; slot = (slot + 1) & mMask) {
+            if (mStates[slot] == EMPTY) {
+                mKeys[slot]   = key;
+                mStates[slot] = state;
+                return true;
+            }
+            if (mKeys[slot] == key) {
+                if (state > mStates[slot]) mStates[slot] = state;
+                return false;
+            }
+        }
+    }
+
+    inline void rehash(size_t capacity);
+
+    Scalar mCellSize;
+    Scalar mInvCellSize;
+    size_t mMask;
+    /// Range of the non-empty cells
+    Eigen::Matrix<std::int64_t, 3, 1> mCellMin, mCellMax;
+    std::vector<std::uint64_t> mKeys;
+    std::vector<std::uint8_t>  mStates;
+};
+
+
+template<typename Scalar>
+void
+OccupancyGrid<Scalar>::rehash(size_t capacity)
+{
+    std::vector<std::uint64_t> keys;
+    std::vector<std::uint8_t>  states;
+    keys.swap(mKeys);
+    states.swap(mStates);
+
+    mKeys.assign(capacity, 0);
+    mStates.assign(capacity, EMPTY);
+    mMask = capacity - 1;
+
+    for (size_t i = 0; i != keys.size(); ++i)
+        if (states[i] != EMPTY)
+            insert(keys[i], CellState(states[i]));
+}
+
+/*!
+  The cells are classified conservatively: a cell is FULL only if its
+  farthest corner is closer than the threshold to a point, and is BORDER as
+  soon as its closest location is at the threshold distance of a point. A
+  margin proportional to the magnitude of the coordinates is used so that the
+  rounding errors in the cell computation cannot contradict an exact query.
+  */
+template<typename Scalar>
+template <typename PointContainer>
+void
+OccupancyGrid<Scalar>::build(const PointContainer& points, Scalar distance)
+{
+    clear();
+    if (points.empty() || distance <= Scalar(0)) return;
+
+    Scalar maxCoord = 0;
+    for (const auto& point : points)
+        maxCoord = std::max(maxCoord, Scalar(point.pos().cwiseAbs().maxCoeff()));
+
+    mCellSize    = distance * kCellRatio;
+    mInvCellSize = Scalar(1) / mCellSize;
+    if ((maxCoord + 2 * distance) * mInvCellSize >= Scalar(kCoordOffset))
+        return;
+
+    const Scalar margin   = Scalar(1e-5) * (maxCoord + distance);
+    const Scalar sqFull   = distance > margin ? (distance - margin) * (distance - margin) : Scalar(0);
+    const Scalar sqBorder = (distance + margin) * (distance + margin);
+
+    size_t count = 0;
+    rehash(1024);
+
+    for (const auto& point : points) {
+        const VectorType p = point.pos().template cast<Scalar>();
+        Eigen::Matrix<std::int64_t, 3, 1> cmin, cmax;
+        for (int d = 0; d != 3; ++d) {
+            cmin[d] = cellCoordinate(p[d] - distance - margin);
+            cmax[d] = cellCoordinate(p[d] + distance + margin);
+        }
+        if (&point == &*points.begin()) {
+            mCellMin = cmin;
+            mCellMax = cmax;
+        } else {
+            mCellMin = mCellMin.cwiseMin(cmin);
+            mCellMax = mCellMax.cwiseMax(cmax);
+        }
+
+        for (std::int64_t x = cmin[0]; x <= cmax[0]; ++x)
+            for (std::int64_t y = cmin[1]; y <= cmax[1]; ++y)
+                for (std::int64_t z = cmin[2]; z <= cmax[2]; ++z) {
+                    const VectorType lo = VectorType(Scalar(x), Scalar(y), Scalar(z)) * mCellSize;
+                    const VectorType hi = lo.array() + mCellSize;
+
+                    // closest and farthest locations of the cell to p
+                    const VectorType closest  = p.cwiseMax(lo).cwiseMin(hi);
+                    const VectorType farthest =
+                            ((p - lo).array() > (hi - p).array()).select(lo, hi);
+
+                    CellState state;
+                    if ((farthest - p).squaredNorm() < sqFull)
+                        state = FULL;
+                    else if ((closest - p).squaredNorm() <= sqBorder)
+                        state = BORDER;
+                    else
+                        continue;
+
+                    if (insert(cellKey(x, y, z), state)) {
+                        // keep the load factor under 1/2
+                        if (2 * (++count) > mKeys.size())
+                            rehash(2 * mKeys.size());
+                    }
+                }
+    }
+}
+
+} // namespace gr
+
+#endif // _OPENGR_ACCELERATORS_OCCUPANCYGRID_H
@@ -49,6 +49,10 @@
 #define _OPENGR_ACCELERATORS_INTERSECTION_FUNCTOR_H_
 
 #include "gr/accelerators/pairExtraction/intersectionNode.h"
+#include "gr/accelerators/pairExtraction/intersectionTree.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <list>
 #include <iostream>
 
@@ -78,6 +82,7 @@ struct IntersectionFunctor{
   typedef _Primitive Primitive;
   typedef _Scalar Scalar;
   enum { dim = _dim };
+  typedef NdTree<Point, dim, Scalar> Tree;
 
   template <class PrimitiveContainer,
             class PointContainer,
@@ -89,13 +94,116 @@ struct IntersectionFunctor{
     Scalar &epsilon,              //!< Intersection accuracy, refined
     unsigned int minNodeSize,    //!< Min number of points in nodes
     ProcessingFunctor& functor
-  );
+  ) const;
+
+  //! \brief Same as above, using a subdivision of Q built beforehand
+  template <class PrimitiveContainer,
+            class ProcessingFunctor> //!< Process the extracted pairs
+  void
+  process(
+    const PrimitiveContainer& M, //!< Input primitives to intersect with Q
+    const Tree              & Q, //!< Subdivision of the normalized point set
+    Scalar &epsilon,              //!< Intersection accuracy, refined
+    ProcessingFunctor& functor
+  ) const;
+
+  /*!
+   * \brief Extracts the pairs of points of Q at distance radius +- epsilon
+   *
+   * Equivalent to the functions above when the primitives are hyperspheres
+   * of a given radius centered on the points of Q, but the subdivision is
+   * traversed once for all the primitives, by pairs of nodes.
+   */
+  template <class ProcessingFunctor> //!< Process the extracted pairs
+  void
+  processDualTree(
+    const Tree              & Q, //!< Subdivision of the normalized point set
+    Scalar radius,               //!< Radius of the primitives
+    Scalar &epsilon,              //!< Intersection accuracy, refined
+    ProcessingFunctor& functor
+  ) const;
+
+  /*!
+   * \brief Extracts the pairs of points of Q for several radii at once
+   *
+   * The pairs of the k-th radius are passed to functor.process(pId, id, k).
+   * The node pairs are pruned and fetched once for all the radii, and the
+   * pairs of each radius are reported in the same order as when calling
+   * processDualTree for this radius only.
+   */
+  template <size_t N,
+            class ProcessingFunctor> //!< Process the extracted pairs
+  void
+  processDualTree(
+    const Tree              & Q, //!< Subdivision of the normalized point set
+    const std::array<Scalar, N>& radii, //!< Radius of the primitives
+    Scalar &epsilon,              //!< Intersection accuracy, refined
+    ProcessingFunctor& functor
+  ) const;
+
+  /*!
+   * \brief Parallel version of processDualTree
+   *
+   * The traversal is split in tasks, processed concurrently by nbThreads
+   * threads. The pairs found by the t-th task are passed to functors[t], a
+   * copy of prototype, so that the functors do not need to be thread-safe.
+   * The pairs of the functors, taken in order, are the same and in the same
+   * order as the pairs given by processDualTree.
+   */
+  template <size_t N,
+            class ProcessingFunctor> //!< Process the extracted pairs
+  void
+  processDualTree(
+    const Tree              & Q, //!< Subdivision of the normalized point set
+    const std::array<Scalar, N>& radii, //!< Radius of the primitives
+    Scalar &epsilon,              //!< Intersection accuracy, refined
+    const ProcessingFunctor& prototype,
+    std::vector<ProcessingFunctor>& functors,
+    int nbThreads
+  ) const;
+
+private:
+  //! \brief Pair of nodes visited by the dual tree traversal
+  struct NodePair{
+    unsigned int a, b;
+    std::uint32_t radii; //!< Radii the pair has not been pruned for
+  };
+
+  /*!
+   * \brief Dual tree traversal starting from the pair of nodes start
+   *
+   * When tasks is not null, the pairs of nodes reaching taskLevel (sum of the
+   * levels of the nodes), or made of leaves, are not processed but appended
+   * to tasks, in the order they would have been processed.
+   */
+  template <size_t N,
+            class ProcessingFunctor>
+  void
+  traverseDualTree(
+    const Tree              & Q,
+    const std::array<Scalar, N>& radii,
+    Scalar epsilon,              //!< Rounded intersection accuracy
+    const NodePair& start,
+    ProcessingFunctor& functor,
+    int taskLevel = 0,
+    std::vector<NodePair>* tasks = nullptr
+  ) const;
+
+  //! \brief Forwards the pairs of a single radius to a ProcessingFunctor
+  template <class ProcessingFunctor>
+  struct SingleRadiusFunctor{
+    ProcessingFunctor& functor;
+    inline void beginPrimitiveCollect(int pId){ functor.beginPrimitiveCollect(pId); }
+    inline void endPrimitiveCollect(int pId){ functor.endPrimitiveCollect(pId); }
+    inline void process(int pId, int id, size_t /*k*/){ functor.process(pId, id); }
+  };
 
 };
 
 
 /*!
-   \return Pairs< PointId, PrimitiveId>
+   Builds the subdivision of Q down to the finest level required by epsilon,
+   and extracts the pairs using this subdivision.
  */
 template <class Primitive, class Point, int dim, typename Scalar>
 template <class PrimitiveContainer,
@@ -108,127 +216,270 @@ IntersectionFunctor<Primitive, Point, dim, Scalar>::process(
     Scalar &epsilon,              //!< Intersection accuracy in [0:1]
     unsigned int minNodeSize,    //!< Min number of points in nodes
     ProcessingFunctor& functor
-    )
+    ) const
 {
-  using std::pow;
+  int lvlMax = 0;
+  GetRoundedEpsilonValue(epsilon, &lvlMax);
 
-  // types definitions
-  typedef NdNode<Point, dim, Scalar, PointContainer> Node;
-  typedef typename std::vector<Node> NodeContainer;
+  Tree tree;
+  tree.build(Q, minNodeSize, lvlMax-1);
+  process(M, tree, epsilon, functor);
+}
 
-  typedef typename Node::IdContainer IdContainer;
-  typedef typename std::pair<unsigned int, unsigned int> ResPair;
-  typedef typename std::vector<ResPair> ResContainer;
+/*!
+   The tree is traversed depth first for each primitive, descending in the
+   nodes intersecting the primitive up to the level defined by epsilon. The
+   points of the reached nodes are then tested individually. Pairs are
+   reported as (PrimitiveId, PointId), with PrimitiveId > PointId.
+ */
+template <class Primitive, class Point, int dim, typename Scalar>
+template <class PrimitiveContainer,
+          class ProcessingFunctor>
+void
+IntersectionFunctor<Primitive, Point, dim, Scalar>::process(
+    const PrimitiveContainer& M, //!< Input primitives to intersect with Q
+    const Tree              & Q, //!< Subdivision of the normalized point set
+    Scalar &epsilon,              //!< Intersection accuracy in [0:1]
+    ProcessingFunctor& functor
+    ) const
+{
+  typedef typename Tree::Node Node;
 
-  // Global variables
-  const unsigned int nbPoint = Q.size();    //!< Number of points
   int lvlMax = 0;
   epsilon = GetRoundedEpsilonValue(epsilon, &lvlMax);
+  if (Q.empty()) return;
 
-  int clvl                   = 0;           //!< Current level
+  const auto& nodes  = Q.nodes();
+  const auto& points = Q.points();
+  const auto& ids    = Q.ids();
 
-  // Use local array and manipulate references to avoid array copies
-  NodeContainer ping, pong;
-  NodeContainer* nodes      = &ping; //!< Nodes of the current level
-  NodeContainer* childNodes = &pong; //!< Child nodes for the next level
+  std::vector<unsigned int> stack;
+  stack.reserve(64);
 
-  //! Nodes too small for split
-  std::vector< std::pair<Node, Scalar> > earlyNodes;
-//
-//  // Fill the idContainer with identity values
-  if (functor.ids.size() != nbPoint){
-    std::cout << "[IntersectionFunctor] Init id array" << std::endl;
-    functor.ids.clear();
-    for(unsigned int i = 0; i < nbPoint; i++)
-      functor.ids.push_back(i);
+  unsigned int pId = 0;
+  for(typename PrimitiveContainer::const_iterator itP = M.begin();
+      itP != M.end(); itP++, pId++){
+    stack.push_back(0);
+    while (! stack.empty()){
+      const Node& n = nodes[stack.back()];
+      stack.pop_back();
+
+      if (! (*itP).intersect(n.center, Tree::halfEdgeLength(n.level)+epsilon))
+        continue;
+
+      // Descend in the children, visited in their storage order
+      if (! n.isLeaf() && n.level < lvlMax-1){
+        for(unsigned int c = n.nbChildren; c-- != 0; )
+          stack.push_back(n.firstChild + c);
+        continue;
+      }
+
+      // Notice the functor we are collecting points for the current primitive
+      functor.beginPrimitiveCollect(pId);
+      for(unsigned int j = n.begin; j != n.end; j++){
+        if(pId>ids[j])
+          if((*itP).intersectPoint(points[j],epsilon))
+            functor.process(pId, ids[j]);
+      }
+      functor.endPrimitiveCollect(pId);
+    }
   }
+}
+
+template <class Primitive, class Point, int dim, typename Scalar>
+template <class ProcessingFunctor>
+void
+IntersectionFunctor<Primitive, Point, dim, Scalar>::processDualTree(
+    const Tree              & Q, //!< Subdivision of the normalized point set
+    Scalar radius,               //!< Radius of the primitives
+    Scalar &epsilon,              //!< Intersection accuracy in [0:1]
+    ProcessingFunctor& functor
+    ) const
+{
+  SingleRadiusFunctor<ProcessingFunctor> single {functor};
+  processDualTree(Q, std::array<Scalar, 1>{{radius}}, epsilon, single);
+}
 
+template <class Primitive, class Point, int dim, typename Scalar>
+template <size_t N,
+          class ProcessingFunctor>
+void
+IntersectionFunctor<Primitive, Point, dim, Scalar>::processDualTree(
+    const Tree              & Q, //!< Subdivision of the normalized point set
+    const std::array<Scalar, N>& radii, //!< Radius of the primitives
+    Scalar &epsilon,              //!< Intersection accuracy in [0:1]
+    ProcessingFunctor& functor
+    ) const
+{
+  static_assert(N <= 32, "The radii of a node pair are stored as a 32 bits mask");
 
-  // Buid root node in the child node, will be copied to the current nodes
-  childNodes->push_back(Node::buildUnitRootNode(Q, functor.ids));
+  epsilon = GetRoundedEpsilonValue(epsilon);
+  if (Q.empty()) return;
 
-  Scalar edgeLength = 0.f;
-  Scalar edgeHalfLength = 0.f;
+  const NodePair root {0, 0, std::uint32_t((std::uint64_t(1) << N) - 1)};
+  traverseDualTree(Q, radii, epsilon, root, functor);
+}
 
-  // First Loop
-  while (clvl != lvlMax-1){
-    // Stop if we not have any nodes to checks
-    if (childNodes->empty())
-      break;
+/*!
+   The tasks are the pairs of nodes reached by the traversal at a given level,
+   which is increased until there are enough tasks to balance the load
+   between the threads.
+ */
+template <class Primitive, class Point, int dim, typename Scalar>
+template <size_t N,
+          class ProcessingFunctor>
+void
+IntersectionFunctor<Primitive, Point, dim, Scalar>::processDualTree(
+    const Tree              & Q, //!< Subdivision of the normalized point set
+    const std::array<Scalar, N>& radii, //!< Radius of the primitives
+    Scalar &epsilon,              //!< Intersection accuracy in [0:1]
+    const ProcessingFunctor& prototype,
+    std::vector<ProcessingFunctor>& functors,
+    int nbThreads
+    ) const
+{
+  static_assert(N <= 32, "The radii of a node pair are stored as a 32 bits mask");
 
-    edgeLength     = Scalar(1.f)/pow(2, clvl);
-    edgeHalfLength = edgeLength/Scalar(2.f);
-
-    // swap pointers
-    std::swap(nodes, childNodes);
-    childNodes->clear();
-
-//#pragma omp parallel
-    for(typename NodeContainer::iterator nit  = nodes->begin();
-                                               nit != nodes->end(); nit++){
-      Node &n = *nit;
-
-      // Check if the current node intersect one of the primitives
-      // In this case, subdivide, store new nodes and stop the loop
-      for(typename PrimitiveContainer::const_iterator pit = M.begin();
-          pit != M.end(); pit++){
-
-        if ((*pit).intersect(n.center(), edgeHalfLength+epsilon)){
-          // There is two options now: either there is already few points in the
-          // current node, in that case we stop splitting it, or we split.
-          if (n.rangeLength() > int(minNodeSize)){
-//#pragma omp critical
-            n.split(*childNodes, edgeHalfLength);
-          }else{
-//#pragma omp critical
-            earlyNodes.emplace_back(n, edgeHalfLength+epsilon);
-          }
-          break;
-        }
-      }
-    }
-    clvl++;
+  functors.clear();
+  epsilon = GetRoundedEpsilonValue(epsilon);
+  if (Q.empty()) return;
+
+  const NodePair root {0, 0, std::uint32_t((std::uint64_t(1) << N) - 1)};
+  const std::size_t minTasks = 16 * std::size_t(std::max(nbThreads, 1));
+
+  std::vector<NodePair> tasks;
+  ProcessingFunctor unused (prototype);
+  for (int taskLevel = 2; ; taskLevel += 2) {
+    tasks.clear();
+    traverseDualTree(Q, radii, epsilon, root, unused, taskLevel, &tasks);
+    if (tasks.size() >= minTasks || taskLevel >= 2 * PAIR_EXTRACTION_MAX_LEVEL)
+      break;
   }
 
-  // Second Loop
-  ResContainer results;
-  results.reserve(childNodes->size());
+  functors.assign(tasks.size(), prototype);
+  const int nbTasks = int(tasks.size());
+#ifdef OpenGR_USE_OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nbThreads)
+#endif
+  for (int t = 0; t < nbTasks; ++t)
+    traverseDualTree(Q, radii, epsilon, tasks[t], functors[t]);
+}
 
-  unsigned int pId = 0;
-  for(typename PrimitiveContainer::const_iterator itP = M.begin();
-      itP != M.end(); itP++, pId++){
-    // add childs
-    for(typename NodeContainer::const_iterator itN = childNodes->begin();
-        itN != childNodes->end(); itN++){
-      if ((*itP).intersect((*itN).center(), epsilon*2.f)){
-
-        functor.beginPrimitiveCollect(pId);
-        for(unsigned int j = 0; j!= (*itN).rangeLength(); j++){
-          if(pId>(*itN).idInRange(j))
-            if((*itP).intersectPoint((*itN).pointInRange(j),epsilon))
-              functor.process(pId, (*itN).idInRange(j));
-        }
-        functor.endPrimitiveCollect(pId);
+/*!
+   Pairs of nodes are visited depth first, starting from the pair (root,
+   root), and are pruned when the distances between their points cannot be in
+   ]radius-epsilon, radius+epsilon[. Unordered pairs of nodes are visited only
+   once, and the largest node of a pair is split first. The points of the
+   pairs of leaves are then tested individually, so that the extracted pairs
+   are the same as with process().
+
+   Each node pair carries the set of radii it has not been pruned for. Since
+   the order of the visits does not depend on the radii, and the pruning is
+   conservative, the pairs of each radius are the same and in the same order
+   as when the radius is processed alone.
+ */
+template <class Primitive, class Point, int dim, typename Scalar>
+template <size_t N,
+          class ProcessingFunctor>
+void
+IntersectionFunctor<Primitive, Point, dim, Scalar>::traverseDualTree(
+    const Tree              & Q,
+    const std::array<Scalar, N>& radii,
+    Scalar epsilon,
+    const NodePair& start,
+    ProcessingFunctor& functor,
+    int taskLevel,
+    std::vector<NodePair>* tasks
+    ) const
+{
+  typedef typename Tree::Node Node;
+
+  const auto& nodes  = Q.nodes();
+  const auto& points = Q.points();
+  const auto& ids    = Q.ids();
+
+  // Bounds of the distances between points of two nodes, with a margin of
+  // epsilon to be conservative wrt rounding errors
+  std::array<Scalar, N> sqMaxDist, sqMinDist;
+  for(size_t k = 0; k != N; k++){
+    const Scalar maxDist = radii[k] + Scalar(2) * epsilon;
+    const Scalar minDist = radii[k] - Scalar(2) * epsilon;
+    sqMaxDist[k] = maxDist * maxDist;
+    sqMinDist[k] = minDist > Scalar(0) ? minDist * minDist : Scalar(-1);
+  }
+
+  // Removes the radii for which the points of a and b cannot form pairs
+  const auto prune = [&](const Node& a, const Node& b, std::uint32_t mask) {
+    const Point gap = (a.center - b.center).cwiseAbs();
+    const Scalar h  = Tree::halfEdgeLength(a.level) + Tree::halfEdgeLength(b.level);
+    const Scalar sqmin = (gap.array() - h).max(Scalar(0)).square().sum();
+    const Scalar sqmax = (gap.array() + h).square().sum();
+    for(size_t k = 0; k != N; k++)
+      if (sqmin >= sqMaxDist[k] || sqmax <= sqMinDist[k])
+        mask &= ~(std::uint32_t(1) << k);
+    return mask;
+  };
+
+  // Tests the points of b against the primitives of a with a greater id
+  const auto collect = [&](const Node& a, const Node& b, std::uint32_t mask) {
+    for(unsigned int i = a.begin; i != a.end; i++){
+      const unsigned int pId = ids[i];
+      functor.beginPrimitiveCollect(pId);
+      for(unsigned int j = b.begin; j != b.end; j++){
+        if(pId>ids[j])
+          for(size_t k = 0; k != N; k++)
+            if((mask >> k) & 1u)
+              if(Primitive::intersectPoint(points[j], epsilon, points[i], radii[k]))
+                functor.process(pId, ids[j], k);
       }
+      functor.endPrimitiveCollect(pId);
+    }
+  };
+
+  std::vector<NodePair> stack;
+  stack.reserve(256);
+  stack.push_back(start);
+
+  while (! stack.empty()){
+    const NodePair np = stack.back();
+    stack.pop_back();
+    const Node& a = nodes[np.a];
+    const Node& b = nodes[np.b];
+
+    const std::uint32_t mask = prune(a, b, np.radii);
+    if (mask == 0)
+      continue;
+
+    if (tasks != nullptr &&
+        (a.level + b.level >= taskLevel || (a.isLeaf() && b.isLeaf()))){
+      tasks->push_back({np.a, np.b, mask});
+      continue;
     }
 
-    // add other leafs
-    for(typename std::vector< std::pair<Node, Scalar> >::const_iterator itPairs =
-                   earlyNodes.begin();
-        itPairs != earlyNodes.end();
-        itPairs++){
-      if((*itP).intersect((*itPairs).first.center(), (*itPairs).second)){
-
-        // Notice the functor we are collecting points for the current primitive
-        functor.beginPrimitiveCollect(pId);
-        for(unsigned int j = 0; j!= (*itPairs).first.rangeLength(); j++){
-          if(pId>(*itPairs).first.idInRange(j))
-            if((*itP).intersectPoint((*itPairs).first.pointInRange(j),epsilon))
-              functor.process(pId, (*itPairs).first.idInRange(j));
-
-        }
-        functor.endPrimitiveCollect(pId);
+    if (np.a == np.b){
+      if (a.isLeaf()){
+        collect(a, a, mask);
+      }else{
+        for(unsigned int c1 = a.firstChild; c1 != a.firstChild+a.nbChildren; c1++)
+          for(unsigned int c2 = c1; c2 != a.firstChild+a.nbChildren; c2++)
+            stack.push_back({c1, c2, mask});
       }
+      continue;
+    }
+
+    if (a.isLeaf() && b.isLeaf()){
+      collect(a, b, mask);
+      collect(b, a, mask);
+      continue;
+    }
+
+    // Split the largest node
+    if (b.isLeaf() || (! a.isLeaf() && a.level <= b.level)){
+      for(unsigned int c = a.firstChild; c != a.firstChild+a.nbChildren; c++)
+        stack.push_back({c, np.b, mask});
+    }else{
+      for(unsigned int c = b.firstChild; c != b.firstChild+b.nbChildren; c++)
+        stack.push_back({np.a, c, mask});
     }
   }
 }
@@ -0,0 +1,158 @@
+// Copyright 2014 Nicolas Mellado
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// Authors: Nicolas Mellado
+//
+// An implementation of the Super 4-points Congruent Sets (Super 4PCS)
+// algorithm presented in:
+//
+// Super 4PCS: Fast Global Pointcloud Registration via Smart Indexing
+// Nicolas Mellado, Dror Aiger, Niloy J. Mitra
+// Symposium on Geometry Processing 2014.
+
+
+#ifndef _OPENGR_ACCELERATORS_INTERSECTION_TREE_H_
+#define _OPENGR_ACCELERATORS_INTERSECTION_TREE_H_
+
+#include "gr/accelerators/pairExtraction/intersectionNode.h"
+
+#include <Eigen/StdVector>
+#include <cstdint>
+#include <vector>
+
+// Default minimum number of points in the split nodes
+#define PAIR_EXTRACTION_MIN_NODE_SIZE 50
+// Default maximum depth of the tree
+#define PAIR_EXTRACTION_MAX_LEVEL 16
+
+namespace gr{
+namespace Accelerators{
+namespace PairExtraction{
+
+/*!
+  \brief Regular subdivision of a point set in the unit hypercube, built once
+  and traversed by the intersection queries.
+
+  The hierarchy is the one generated by NdNode::split, stored as a flat array
+  of nodes in breadth first order: the children of a node are contiguous. The
+  points are copied in the order of the leaves, so that each node covers a
+  contiguous range of points.
+
+  \see IntersectionFunctor
+ */
+template <class _Point, int _dim, typename _Scalar>
+class NdTree{
+public:
+  typedef _Point  Point;
+  typedef _Scalar Scalar;
+  enum { Dim = _dim };
+
+  typedef std::vector<Point, Eigen::aligned_allocator<Point> > PointContainer;
+  typedef std::vector<unsigned int> IdContainer;
+
+  struct Node{
+    Point center;              //!< Center of the node in the nd-space
+    unsigned int begin,        //!< First point of the node
+                 end;          //!< Last point of the node
+    unsigned int firstChild;   //!< Id of the first child in the node array
+    unsigned int nbChildren;   //!< Number of non-empty children, 0 for leaves
+    int          level;        //!< Depth of the node, the root level is 0
+
+    inline unsigned int rangeLength() const { return end - begin; }
+    inline bool isLeaf() const { return nbChildren == 0; }
+  };
+  typedef std::vector<Node, Eigen::aligned_allocator<Node> > NodeContainer;
+
+  /*!
+   * \brief Builds the tree over points, which must lie in [0:1]^d
+   *
+   * Nodes containing more than minNodeSize points are split, up to the
+   * level maxLevel.
+   */
+  template <class InputContainer>
+  inline void build(const InputContainer& points,
+                    unsigned int minNodeSize = PAIR_EXTRACTION_MIN_NODE_SIZE,
+                    int maxLevel = PAIR_EXTRACTION_MAX_LEVEL);
+
+  inline void clear() { _nodes.clear(); _points.clear(); _ids.clear(); }
+  inline bool empty() const { return _nodes.empty(); }
+
+  //! \brief Nodes in breadth first order, the root being the first one
+  inline const NodeContainer& nodes() const { return _nodes; }
+  //! \brief Points ordered by node
+  inline const PointContainer& points() const { return _points; }
+  //! \brief Id of the points in the input container
+  inline const IdContainer& ids() const { return _ids; }
+
+  //! \brief Half length of the edges of the nodes of a given level
+  static inline Scalar halfEdgeLength(int level) {
+    return Scalar(1) / Scalar(std::uint64_t(2) << level);
+  }
+
+private:
+  NodeContainer  _nodes;
+  PointContainer _points;
+  IdContainer    _ids;
+};
+
+
+template <class Point, int dim, typename Scalar>
+template <class InputContainer>
+void
+NdTree<Point, dim, Scalar>::build(const InputContainer& points,
+                                  unsigned int minNodeSize,
+                                  int maxLevel)
+{
+  typedef NdNode<Point, dim, Scalar, InputContainer> BuildNode;
+
+  clear();
+  if (points.empty()) return;
+
+  for(unsigned int i = 0; i < points.size(); i++)
+    _ids.push_back(i);
+
+  // Split the nodes level by level, the nodes being processed in their
+  // creation order
+  std::vector<BuildNode> children;
+  const BuildNode root = BuildNode::buildUnitRootNode(points, _ids);
+  _nodes.push_back({root.center(), root.rangeBegin(), root.rangeEnd(), 0, 0, 0});
+
+  for(unsigned int n = 0; n != _nodes.size(); n++){
+    if (_nodes[n].level >= maxLevel || _nodes[n].rangeLength() <= minNodeSize)
+      continue;
+
+    BuildNode node (points, _ids, _nodes[n].center,
+                    _nodes[n].begin, _nodes[n].end);
+    children.clear();
+    node.split(children, halfEdgeLength(_nodes[n].level));
+
+    _nodes[n].firstChild = _nodes.size();
+    _nodes[n].nbChildren = children.size();
+    const int level = _nodes[n].level + 1;
+    for(const BuildNode& c : children)
+      _nodes.push_back({c.center(), c.rangeBegin(), c.rangeEnd(), 0, 0, level});
+  }
+
+  _points.reserve(points.size());
+  for(unsigned int id : _ids)
+    _points.push_back(points[id]);
+}
+
+} // namespace PairExtraction
+} // namespace Accelerators
+} // namespace gr
+
+#endif // _OPENGR_ACCELERATORS_INTERSECTION_TREE_H_
@@ -0,0 +1,126 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _OPENGR_ACCELERATORS_PAIR_DISTANCE_INDEX_H_
+#define _OPENGR_ACCELERATORS_PAIR_DISTANCE_INDEX_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Default number of distance buckets
+#define PAIR_DISTANCE_INDEX_BUCKETS 16384
+
+namespace gr{
+namespace Accelerators{
+namespace PairExtraction{
+
+/*!
+  \brief Index of all the pairs of a point set in the unit hypercube, sorted
+  by quantized distance.
+
+  The pairs (i, j), i > j, are stored in a flat array, grouped by bucket of
+  distance, with an offset table giving the first pair of each bucket. The
+  pairs at a given distance range are then found by a contiguous scan. The
+  index stores n(n-1)/2 pairs, and is intended for point sets of a few
+  thousand points.
+ */
+template <class _Point, int _dim, typename _Scalar>
+class PairDistanceIndex{
+public:
+  typedef _Point  Point;
+  typedef _Scalar Scalar;
+  enum { Dim = _dim };
+
+  typedef std::pair<unsigned int, unsigned int> IndexPair;
+  typedef typename std::vector<IndexPair>::const_iterator const_iterator;
+
+  //! \brief Builds the index over points, which must lie in [0:1]^d
+  template <class PointContainer>
+  inline void build(const PointContainer& points,
+                    unsigned int nbBuckets = PAIR_DISTANCE_INDEX_BUCKETS);
+
+  inline void clear() { _pairs.clear(); _offsets.clear(); }
+  inline bool empty() const { return _offsets.empty(); }
+  //! \brief Number of indexed pairs
+  inline std::size_t size() const { return _pairs.size(); }
+
+  /*!
+   * \brief Range of pairs containing all the pairs at distance in
+   * [minDist, maxDist]
+   *
+   * The range is conservative: it covers the whole buckets overlapping the
+   * distance interval, plus one bucket on each side to account for rounding
+   * errors, so the distances of the pairs must be checked by the caller.
+   */
+  inline std::pair<const_iterator, const_iterator>
+  range(Scalar minDist, Scalar maxDist) const {
+    if (empty() || maxDist < minDist)
+      return std::make_pair(_pairs.end(), _pairs.end());
+    const std::size_t first = bucket(minDist);
+    const std::size_t last  = std::min(bucket(maxDist) + 2, _offsets.size() - 1);
+    return std::make_pair(_pairs.begin() + _offsets[first > 0 ? first - 1 : 0],
+                          _pairs.begin() + _offsets[last]);
+  }
+
+private:
+  //! \brief Bucket of a distance, clamped to the valid buckets
+  inline std::size_t bucket(Scalar d) const {
+    const Scalar b = std::floor(d / _step);
+    if (! (b > Scalar(0))) return 0;
+    return std::min(std::size_t(b), _offsets.size() - 2);
+  }
+
+  std::vector<IndexPair>   _pairs;
+  std::vector<std::size_t> _offsets; //!< First pair of each bucket, plus the end
+  Scalar _step;                      //!< Width of the buckets
+};
+
+
+/*!
+  The pairs are distributed in the buckets by a counting sort, so that they
+  keep the order of the enumeration within each bucket.
+ */
+template <class Point, int dim, typename Scalar>
+template <class PointContainer>
+void
+PairDistanceIndex<Point, dim, Scalar>::build(const PointContainer& points,
+                                             unsigned int nbBuckets)
+{
+  clear();
+  nbBuckets = std::max(nbBuckets, 1u);
+  // largest distance in the unit hypercube
+  _step = std::sqrt(Scalar(Dim)) / Scalar(nbBuckets);
+  _offsets.assign(nbBuckets + 1, 0);
+
+  const unsigned int n = points.size();
+  for(unsigned int j = 0; j < n; j++)
+    for(unsigned int i = j+1; i < n; i++)
+      _offsets[bucket((points[i] - points[j]).norm()) + 1]++;
+
+  for(unsigned int b = 0; b != nbBuckets; b++)
+    _offsets[b+1] += _offsets[b];
+
+  std::vector<std::size_t> next (_offsets.begin(), _offsets.end() - 1);
+  _pairs.resize(_offsets.back());
+  for(unsigned int j = 0; j < n; j++)
+    for(unsigned int i = j+1; i < n; i++)
+      _pairs[next[bucket((points[i] - points[j]).norm())]++] = IndexPair(i, j);
+}
+
+} // namespace PairExtraction
+} // namespace Accelerators
+} // namespace gr
+
+#endif // _OPENGR_ACCELERATORS_PAIR_DISTANCE_INDEX_H_
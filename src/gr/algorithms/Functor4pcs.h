@@ -6,7 +6,9 @@
 #define OPENGR_FUNCTOR4PCS_H
 
 #include <vector>
+
 #include "gr/shared.h"
+#include "gr/algorithms/FunctorBase4pcs.h"
 
 
 namespace gr {
@@ -15,36 +17,26 @@ namespace gr {
     /// \tparam PairFilterFunctor filters pairs of points during the exploration.
     ///         Must implement PairFilterConcept
     template <typename PairFilterFunctor, typename Options>
-    struct Functor4PCS {
+    struct Functor4PCS : public FunctorBase4PCS<PairFilterFunctor, Options> {
     public :
-        using BaseCoordinates = Traits4pcs::Coordinates;
-        using Scalar      = typename Point3D::Scalar;
-        using PairsVector = std::vector< std::pair<int, int> >;
-        using VectorType  = typename Point3D::VectorType;
-        using OptionType  = Options;
+        using Base        = FunctorBase4PCS<PairFilterFunctor, Options>;
+        using BaseCoordinates = typename Base::BaseCoordinates;
+        using Scalar      = typename Base::Scalar;
+        using PairsVector = typename Base::PairsVector;
+        using VectorType  = typename Base::VectorType;
+        using OptionType  = typename Base::OptionType;
 
 
     private :
-        OptionType myOptions_;
-        std::vector<Point3D>& mySampled_Q_3D_;
-        BaseCoordinates &myBase_3D_;
+        using Base::mySampled_Q_3D_;
+        using Base::deadline_;
 
 
     public :
         inline Functor4PCS(std::vector<Point3D> &sampled_Q_3D_,
                          BaseCoordinates& base_3D_,
                          const OptionType &options)
-                        :mySampled_Q_3D_(sampled_Q_3D_)
-                        ,myBase_3D_(base_3D_)
-                        ,myOptions_ (options) {}
-
-        /// Initializes the data structures and needed values before the match
-        /// computation.
-        /// @param [in] point_P First input set.
-        /// @param [in] point_Q Second input set.
-        /// expected to be in the inliers.
-        inline void Initialize(const std::vector<Point3D>& /*P*/,
-                                   const std::vector<Point3D>& /*Q*/) {}
+                        :Base(sampled_Q_3D_, base_3D_, options) {}
 
         /// Finds congruent candidates in the set Q, given the invariants and threshold distances.
         /// Returns true if a non empty set can be found, false otherwise.
@@ -91,6 +83,7 @@ namespace gr {
             //Point3D invRes;
             // Query the Kdtree for all the points corresponding to the invariants in Second_pairs.
             for (size_t i = 0; i < Second_pairs.size(); ++i) {
+                if ((i & 63) == 0 && deadline_.expired()) break;
                 const VectorType &p1 = mySampled_Q_3D_[Second_pairs[i].first].pos();
                 const VectorType &p2 = mySampled_Q_3D_[Second_pairs[i].second].pos();
 
@@ -110,57 +103,6 @@ namespace gr {
 
             return quadrilaterals->size() != 0;
         }
-
-        /// Constructs pairs of points in Q, corresponding to a single pair in the
-        /// in basein P.
-        /// @param [in] pair_distance The distance between the pairs in P that we have
-        /// to match in the pairs we select from Q.
-        /// @param [in] pair_normal_distance The angle between the normals of the pair
-        /// in P.
-        /// @param [in] pair_distance_epsilon Tolerance on the pair distance. We allow
-        /// candidate pair in Q to have distance of
-        /// pair_distance+-pair_distance_epsilon.
-        /// @param [in] base_point1 The index of the first point in P.
-        /// @param [in] base_point2 The index of the second point in P.
-        /// @param [out] pairs A set of pairs in Q that match the pair in P with
-        /// respect to distance and normals, up to the given tolerance.
-       inline void ExtractPairs(Scalar pair_distance,
-                                Scalar pair_normals_angle,
-                                Scalar pair_distance_epsilon,
-                                int base_point1,
-                                int base_point2,
-                                PairsVector* pairs) const {
-            if (pairs == nullptr) return;
-
-            pairs->clear();
-            pairs->reserve(2 * mySampled_Q_3D_.size());
-
-            PairFilterFunctor fun;
-
-            // Go over all ordered pairs in Q.
-            for (size_t j = 0; j < mySampled_Q_3D_.size(); ++j) {
-                const Point3D& p = mySampled_Q_3D_[j];
-                for (size_t i = j + 1; i < mySampled_Q_3D_.size(); ++i) {
-                    const Point3D& q = mySampled_Q_3D_[i];
-#ifndef MULTISCALE
-                    // Compute the distance and two normal angles to ensure working with
-                    // wrong orientation. We want to verify that the angle between the
-                    // normals is close to the angle between normals in the base. This can be
-                    // checked independent of the full rotation angles which are not yet
-                    // defined by segment matching alone..
-                    const Scalar distance = (q.pos() - p.pos()).norm();
-                    if (std::abs(distance - pair_distance) > pair_distance_epsilon) continue;
-#endif
-
-                    std::pair<bool,bool> res = fun(p,q, pair_normals_angle, myBase_3D_[base_point1],myBase_3D_[base_point2], myOptions_);
-                    if (res.first)
-                        pairs->emplace_back(i, j);
-                    if (res.second)
-                        pairs->emplace_back(j, i);
-                }
-            }
-        }
-
      };
 }
 
@@ -0,0 +1,178 @@
+#ifndef OPENGR_FUNCTORBASE4PCS_H
+#define OPENGR_FUNCTORBASE4PCS_H
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#ifdef OpenGR_USE_OPENMP
+#include <omp.h>
+#endif
+
+#include "gr/shared.h"
+#include "gr/utils/deadline.h"
+#include "gr/algorithms/match4pcsBase.h"
+
+
+namespace gr {
+    /// Base of the 4PCS processing functors extracting the pairs of Q by going
+    /// over all the pairs of points
+    /// \see Functor4PCS, FunctorBrute4PCS
+    /// \tparam PairFilterFunctor filters pairs of points during the exploration.
+    ///         Must implement PairFilterConcept
+    template <typename PairFilterFunctor, typename Options>
+    struct FunctorBase4PCS {
+    public :
+        using BaseCoordinates = Traits4pcs::Coordinates;
+        using Scalar      = typename Point3D::Scalar;
+        using PairsVector = std::vector< std::pair<int, int> >;
+        using VectorType  = typename Point3D::VectorType;
+        using OptionType  = Options;
+
+
+    protected :
+        OptionType myOptions_;
+        std::vector<Point3D>& mySampled_Q_3D_;
+        BaseCoordinates &myBase_3D_;
+        Utils::Deadline deadline_;
+
+
+    public :
+        inline FunctorBase4PCS(std::vector<Point3D> &sampled_Q_3D_,
+                               BaseCoordinates& base_3D_,
+                               const OptionType &options)
+                        :myOptions_ (options)
+                        ,mySampled_Q_3D_(sampled_Q_3D_)
+                        ,myBase_3D_(base_3D_) {}
+
+        /// The pairs are extracted from the sampled Q only, so there is no
+        /// data structure to build nor to share with the workers.
+        /// \see Match4pcsBase
+        inline void Initialize(const std::vector<Point3D>& /*P*/,
+                               const std::vector<Point3D>& /*Q*/) {}
+
+        inline void InitializeWorker(const FunctorBase4PCS& /*main*/) {}
+
+        inline void setDeadline(const Utils::Deadline& deadline) { deadline_ = deadline; }
+
+        /// Constructs pairs of points in Q, corresponding to a single pair in the
+        /// in basein P.
+        /// @param [in] pair_distance The distance between the pairs in P that we have
+        /// to match in the pairs we select from Q.
+        /// @param [in] pair_normal_distance The angle between the normals of the pair
+        /// in P.
+        /// @param [in] pair_distance_epsilon Tolerance on the pair distance. We allow
+        /// candidate pair in Q to have distance of
+        /// pair_distance+-pair_distance_epsilon.
+        /// @param [in] base_point1 The index of the first point in P.
+        /// @param [in] base_point2 The index of the second point in P.
+        /// @param [out] pairs A set of pairs in Q that match the pair in P with
+        /// respect to distance and normals, up to the given tolerance.
+       inline void ExtractPairs(Scalar pair_distance,
+                                Scalar pair_normals_angle,
+                                Scalar pair_distance_epsilon,
+                                int base_point1,
+                                int base_point2,
+                                PairsVector* pairs) const {
+            if (pairs == nullptr) return;
+
+            const std::array<PairExtractionQuery, 1> queries {{
+                { pair_distance, pair_normals_angle, base_point1, base_point2, pairs } }};
+            ExtractPairs(queries, pair_distance_epsilon);
+        }
+
+        /// Constructs the pairs of points in Q corresponding to several pairs
+        /// in the base, in a single pass over the pairs of Q.
+        /// @param [in] queries The pairs of the base, and the output pairs.
+        /// @param [in] pair_distance_epsilon Tolerance on the pair distances.
+        /// \see ExtractPairs
+        template <size_t N>
+        inline void ExtractPairs(const std::array<PairExtractionQuery, N>& queries,
+                                 Scalar pair_distance_epsilon) const {
+            std::array<PairsVector*, N> pairs;
+            for (size_t k = 0; k != N; ++k) {
+                pairs[k] = queries[k].pairs;
+                pairs[k]->clear();
+                pairs[k]->reserve(2 * mySampled_Q_3D_.size());
+            }
+
+#ifdef OpenGR_USE_OPENMP
+            const int nbThreads = myOptions_.nthread_pairs > 0 ? myOptions_.nthread_pairs
+                                                                : omp_get_max_threads();
+            if (nbThreads > 1) {
+                // The outer loop is split in blocks processed concurrently,
+                // the pairs of each block being collected in its own buffers,
+                // and concatenated in the block order.
+                const size_t blockSize = 32;
+                const int nbBlocks = int((mySampled_Q_3D_.size() + blockSize - 1) / blockSize);
+                std::vector<std::array<PairsVector, N> > blocks (nbBlocks);
+
+#pragma omp parallel for schedule(dynamic) num_threads(nbThreads)
+                for (int b = 0; b < nbBlocks; ++b) {
+                    std::array<PairsVector*, N> blockPairs;
+                    for (size_t k = 0; k != N; ++k)
+                        blockPairs[k] = &blocks[b][k];
+                    ExtractPairsRange(queries, pair_distance_epsilon,
+                                      b * blockSize,
+                                      std::min((b + 1) * blockSize, mySampled_Q_3D_.size()),
+                                      blockPairs);
+                }
+
+                for (const auto& block : blocks)
+                    for (size_t k = 0; k != N; ++k)
+                        pairs[k]->insert(pairs[k]->end(), block[k].begin(), block[k].end());
+                return;
+            }
+#endif
+
+            ExtractPairsRange(queries, pair_distance_epsilon, 0, mySampled_Q_3D_.size(), pairs);
+        }
+
+    private :
+        /// Constructs the pairs (i, j) of Q, i > j, for j in [begin, end[,
+        /// and appends them to pairs.
+        template <size_t N>
+        inline void ExtractPairsRange(const std::array<PairExtractionQuery, N>& queries,
+                                      Scalar pair_distance_epsilon,
+                                      size_t begin,
+                                      size_t end,
+                                      const std::array<PairsVector*, N>& pairs) const {
+            PairFilterFunctor fun;
+
+            // Go over all ordered pairs in Q.
+            for (size_t j = begin; j < end; ++j) {
+                if (deadline_.expired()) break;
+                const Point3D& p = mySampled_Q_3D_[j];
+                for (size_t i = j + 1; i < mySampled_Q_3D_.size(); ++i) {
+                    const Point3D& q = mySampled_Q_3D_[i];
+#ifndef MULTISCALE
+                    // Compute the distance and two normal angles to ensure working with
+                    // wrong orientation. We want to verify that the angle between the
+                    // normals is close to the angle between normals in the base. This can be
+                    // checked independent of the full rotation angles which are not yet
+                    // defined by segment matching alone..
+                    const Scalar distance = (q.pos() - p.pos()).norm();
+#endif
+                    for (size_t k = 0; k != N; ++k) {
+                        const PairExtractionQuery& query = queries[k];
+#ifndef MULTISCALE
+                        if (std::abs(distance - query.pair_distance) > pair_distance_epsilon) continue;
+#endif
+
+                        std::pair<bool,bool> res = fun(p,q, query.pair_normals_angle,
+                                                       myBase_3D_[query.base_point1],
+                                                       myBase_3D_[query.base_point2], myOptions_);
+                        if (res.first)
+                            pairs[k]->emplace_back(i, j);
+                        if (res.second)
+                            pairs[k]->emplace_back(j, i);
+                    }
+                }
+            }
+        }
+
+     };
+}
+
+
+#endif //OPENGR_FUNCTORBASE4PCS_H
@@ -7,6 +7,11 @@
 
 
 #include <vector>
+
+#ifdef OpenGR_USE_OPENMP
+#include <omp.h>
+#endif
+
 #include "gr/shared.h"
 #include "gr/algorithms/pairCreationFunctor.h"
 
@@ -54,16 +59,23 @@ namespace gr {
                                 ,mySampled_Q_3D_(sampled_Q_3D_)
                                 ,myBase_3D_(base_3D_){}
 
-        /// Initializes the data structures and needed values before the match
-        /// computation.
-        /// @param [in] point_P First input set.
-        /// @param [in] point_Q Second input set.
-        /// expected to be in the inliers.
+        /// Builds the subdivision of the sampled Q, and its pair index when
+        /// enabled in the options.
+        /// \see Match4pcsBase
         inline void Initialize(const std::vector<Point3D>& /*P*/,
                                    const std::vector<Point3D>& /*Q*/) {
             pcfunctor_.synch3DContent();
         }
 
+        /// The structures are shared with main, which must outlive this functor.
+        inline void InitializeWorker(const FunctorSuper4PCS& main) {
+            pcfunctor_.synch3DContent(main.pcfunctor_);
+        }
+
+        inline void setDeadline(const Utils::Deadline& deadline) {
+            pcfunctor_.deadline = deadline;
+        }
+
 
         /// Constructs pairs of points in Q, corresponding to a single pair in the
         /// in basein P.
@@ -82,36 +94,92 @@ namespace gr {
                                  int base_point1,
                                  int base_point2,
                                  PairsVector* pairs) const {
+            if (pairs == nullptr) return;
 
-            using namespace gr::Accelerators::PairExtraction;
+            const std::array<PairExtractionQuery, 1> queries {{
+                { pair_distance, pair_normals_angle, base_point1, base_point2, pairs } }};
+            ExtractPairs(queries, pair_distance_epsilon);
+        }
+
+        /// Constructs the pairs of points in Q corresponding to several pairs
+        /// in the base, in a single traversal of the subdivision of Q.
+        /// @param [in] queries The pairs of the base, and the output pairs.
+        /// @param [in] pair_distance_epsilon Tolerance on the pair distances.
+        /// \see ExtractPairs
+        template <size_t N>
+        inline void ExtractPairs(const std::array<PairExtractionQuery, N>& queries,
+                                 Scalar pair_distance_epsilon) const {
 
-            pcfunctor_.pairs = pairs;
+            using namespace gr::Accelerators::PairExtraction;
 
-            pairs->clear();
-            pairs->reserve(2 * pcfunctor_.points.size());
+            for (const auto& query : queries) {
+                query.pairs->clear();
+                query.pairs->reserve(2 * pcfunctor_.points.size());
+            }
 
-            pcfunctor_.pair_distance         = pair_distance;
             pcfunctor_.pair_distance_epsilon = pair_distance_epsilon;
-            pcfunctor_.pair_normals_angle    = pair_normals_angle;
-            pcfunctor_.setRadius(pair_distance);
-            pcfunctor_.setBase(base_point1, base_point2, myBase_3D_);
 
 #ifdef MULTISCALE
             BruteForceFunctor
   <typename PairCreationFunctorType::Primitive, typename PairCreationFunctorType::Point, 3, Scalar> interFunctor;
+
+            // the primitives have a single radius, process the queries one by one
+            for (const auto& query : queries) {
+                Scalar eps = pcfunctor_.getNormalizedEpsilon(pair_distance_epsilon);
+                pcfunctor_.setQueries(&query, 1, myBase_3D_);
+                pcfunctor_.setRadius(query.pair_distance);
+                interFunctor.process(pcfunctor_.primitives,
+                                     pcfunctor_.points,
+                                     eps,
+                                     50,
+                                     pcfunctor_);
+            }
 #else
             IntersectionFunctor
                     <typename PairCreationFunctorType::Primitive,
                      typename PairCreationFunctorType::Point, 3, Scalar> interFunctor;
-#endif
 
             Scalar eps = pcfunctor_.getNormalizedEpsilon(pair_distance_epsilon);
+            std::array<Scalar, N> radii;
+            for (size_t k = 0; k != N; ++k)
+                radii[k] = pcfunctor_.getNormalizedRadius(queries[k].pair_distance);
+            pcfunctor_.setQueries(queries.data(), N, myBase_3D_);
+
+            // the pairs are read from the index built by Initialize
+            if (! pcfunctor_.pairIndex().empty()) {
+                pcfunctor_.processIndexedPairs();
+                return;
+            }
 
-            interFunctor.process(pcfunctor_.primitives,
-                                 pcfunctor_.points,
-                                 eps,
-                                 50,
-                                 pcfunctor_);
+#ifdef OpenGR_USE_OPENMP
+            const int nbThreads = pcfunctor_.options_.nthread_pairs > 0
+                    ? pcfunctor_.options_.nthread_pairs : omp_get_max_threads();
+            if (nbThreads > 1) {
+                // the pairs of each part of the traversal are collected in
+                // their own buffers, and concatenated in the traversal order
+                std::vector<typename PairCreationFunctorType::PairCollector> collectors;
+                interFunctor.processDualTree(pcfunctor_.tree(),
+                                             radii,
+                                             eps,
+                                             pcfunctor_.collector(),
+                                             collectors,
+                                             nbThreads);
+                for (const auto& collector : collectors)
+                    for (size_t k = 0; k != N; ++k)
+                        queries[k].pairs->insert(queries[k].pairs->end(),
+                                                 collector.pairs[k].begin(),
+                                                 collector.pairs[k].end());
+                return;
+            }
+#endif
+
+            // the subdivision of Q is built once by Initialize, and the
+            // primitives are the spheres centered on its points
+            interFunctor.processDualTree(pcfunctor_.tree(),
+                                         radii,
+                                         eps,
+                                         pcfunctor_);
+#endif
         }
 
         /// Finds congruent candidates in the set Q, given the invariants and threshold
@@ -179,6 +247,7 @@ namespace gr {
             std::vector<unsigned int> nei;
             // 2. Query time
             for (unsigned int i = 0; i < Second_pairs.size(); ++i) {
+                if ((i & 63) == 0 && pcfunctor_.deadline.expired()) break;
                 const Point& p1 = pcfunctor_.points[Second_pairs[i].first];
                 const Point& p2 = pcfunctor_.points[Second_pairs[i].second];
 
@@ -45,6 +45,12 @@
 #define _OPENGR_ALGO_CSE_
 
 #include <vector>
+#include <array>
+#include <unordered_map>
+#include <memory>
+#include <random>
+
+#include <Eigen/StdVector>
 
 #ifdef OpenGR_USE_OPENMP
 #include <omp.h>
@@ -74,6 +80,60 @@ public:
     }
     inline Scalar getTerminateThreshold() const { return terminate_threshold; }
     inline Scalar getOverlapEstimation()  const { return overlap_estimation; }
+
+    /// Number of threads used to verify the congruent sets. Set to 0 to use
+    /// the default number of OpenMP threads. Ignored when compiled without
+    /// OpenMP.
+    int nthread_congruent = 1;
+    /// Number of RANSAC trials explored concurrently, each thread having its
+    /// own random generator. Set to 0 to use the default number of OpenMP
+    /// threads. Ignored when compiled without OpenMP.
+    int nthread_trials = 1;
+    /// Number of threads used to extract the pairs of Q matching the pairs
+    /// of the base. The extracted pairs do not depend on the number of
+    /// threads. Set to 0 to use the default number of OpenMP threads. Ignored
+    /// when compiled without OpenMP.
+    int nthread_pairs = 1;
+    /// Index all the pairs of the sampled Q by distance once, so that the
+    /// pairs matching the base are found by scanning a range of the index
+    /// instead of searching Q at each trial. The index stores n(n-1)/2 pairs
+    /// for n samples, and is intended for a few thousand samples. Only used
+    /// by Super4PCS.
+    bool use_pair_index = false;
+    /// Make the result independent of the number of threads: each RANSAC
+    /// trial draws its base from its own random stream, derived from the
+    /// random seed and the trial index, and ties between candidates are
+    /// broken by LCP, then trial index, then congruent set index. The SPRT
+    /// verification and the transformation cache depend on the execution
+    /// order, and are disabled in this mode.
+    bool deterministic_trials = false;
+
+    /// Use a sequential probability ratio test (SPRT) to stop the
+    /// verification of the transformations that are unlikely to improve the
+    /// current best LCP. The points of Q are then visited in a random order.
+    bool use_sprt_verification = false;
+    /// Probability for the SPRT to reject a transformation with a LCP equal to
+    /// the current best LCP.
+    Scalar sprt_false_rejection = Scalar(0.01);
+    /// LCP of the transformations the SPRT must reject, expressed as a
+    /// fraction of the current best LCP.
+    Scalar sprt_bad_ratio = Scalar(0.5);
+
+    /// Remember the LCP of the verified transformations, and reuse it for the
+    /// transformations falling in the same cell of the quantized SE(3) space.
+    /// The translation is quantized by delta.
+    bool use_transformation_cache = false;
+    /// Quantization step of the unit quaternion components used by the
+    /// transformation cache.
+    Scalar transformation_cache_rotation_step = Scalar(0.01);
+
+    /// Reduce the number of trials during the exploration, using the best LCP
+    /// as an estimation of the inlier ratio (adaptive RANSAC). The number of
+    /// trials is never increased above the initial estimation.
+    bool use_adaptive_trials = false;
+    /// Probability to draw at least one base made of inliers, used to compute
+    /// the number of trials when use_adaptive_trials is enabled.
+    Scalar adaptive_trials_confidence = Scalar(0.99);
 private:
     /// Threshold on the value of the target function (LCP, see the paper).
     /// It is used to terminate the process once we reached this value.
@@ -111,6 +171,18 @@ public:
     using MatrixType = typename MatchBaseType::MatrixType;
     static constexpr Scalar kLargeNumber = 1e9;
     static constexpr Scalar distance_factor = 2.0;
+    /// Number of points of Q transformed at once by Verify.
+    static constexpr int kVerifyBatchSize = 64;
+    /// Number of candidates of a congruent set verified between two updates of
+    /// the LCP used to stop the verifications early.
+    static constexpr int kVerifyBlockSize = 256;
+    /// Number of trials run by each worker between two synchronizations, when
+    /// the trials are run in parallel.
+    static constexpr int kTrialsPerWorkerAndRound = 2;
+    static constexpr int kMinNumberOfTrials = 4;
+    /// Fraction of the diameter of P bounding the distance between the points
+    /// of the bases, used to estimate the number of trials.
+    static constexpr Scalar kDiameterFraction = 0.3;
 
     using LogLevel = typename MatchBaseType::LogLevel;
 
@@ -132,14 +204,41 @@ public:
     /// Q to the (approximate) optimal LCP. Initial value is considered as a guess
     /// @return the computed LCP measure as a fraction of the size of P ([0..1]).
     template <typename Sampler>
-    Scalar ComputeTransformation(const std::vector<Point3D>& P,
-                                 const std::vector<Point3D>& Q,
-                                 Eigen::Ref<MatrixType> transformation,
-                                 const Sampler& sampler,
-                                 TransformVisitor& v);
+    inline Scalar ComputeTransformation(const std::vector<Point3D>& P,
+                                        const std::vector<Point3D>& Q,
+                                        Eigen::Ref<MatrixType> transformation,
+                                        const Sampler& sampler,
+                                        TransformVisitor& v)
+    { return ComputeTransformationImpl(P, Q, transformation, sampler, v); }
+
+    /// Same as ComputeTransformation(P, Q, transformation, sampler, v), using
+    /// a target set P prepared once for all the registrations. Only Q is
+    /// sampled by the sampler.
+    template <typename Sampler>
+    inline Scalar ComputeTransformation(const PreparedTarget& P,
+                                        const std::vector<Point3D>& Q,
+                                        Eigen::Ref<MatrixType> transformation,
+                                        const Sampler& sampler,
+                                        TransformVisitor& v)
+    { return ComputeTransformationImpl(P, Q, transformation, sampler, v); }
+
+    /// Number of transformations whose LCP was read from the transformation
+    /// cache during the last call to ComputeTransformation
+    size_t getTransformationCacheHits()   const { return transformation_cache_hits_; }
+    /// Number of transformations verified and added to the transformation
+    /// cache during the last call to ComputeTransformation
+    size_t getTransformationCacheMisses() const { return transformation_cache_misses_; }
 
 
 protected:
+    /// Implementation of ComputeTransformation, for a raw or prepared P
+    template <typename TargetType, typename Sampler>
+    Scalar ComputeTransformationImpl(const TargetType& P,
+                                     const std::vector<Point3D>& Q,
+                                     Eigen::Ref<MatrixType> transformation,
+                                     const Sampler& sampler,
+                                     TransformVisitor& v);
+
     /// Number of trials. Every trial picks random base from P.
     int number_of_trials_;
     /// The points in the base (indices to P). It is being updated in every
@@ -155,12 +254,130 @@ protected:
     Scalar best_LCP_;
     /// Current trial.
     int current_trial_;
+    /// Coordinates of sampled_Q_3D_ stored as structure of arrays (one column
+    /// per dimension), so Verify can transform the points by batches. The
+    /// points are shuffled when the SPRT verification is enabled.
+    Eigen::Array<Scalar, Eigen::Dynamic, 3> sampled_Q_3D_soa_;
 
 #ifdef OpenGR_USE_OPENMP
     /// number of threads used to verify the congruent set
     const int omp_nthread_congruent_;
 #endif
 
+    /// Random generator and base used to run a RANSAC trial.
+    struct TrialContext {
+        std::mt19937& randomGenerator;
+        Coordinates&  base3D;
+        /// Index of the worker owning the state, -1 for the matcher state
+        /// (randomGenerator_ and base_3D_)
+        int id;
+    };
+
+    /// State owned by a thread running RANSAC trials in parallel
+    struct TrialWorker {
+        std::mt19937 randomGenerator;
+        Coordinates  base3D;
+    };
+
+    /// Workers used to run the trials in parallel. Empty if the trials are
+    /// run sequentially.
+    std::vector<std::unique_ptr<TrialWorker> > trial_workers_;
+
+    /// Random generator used by the sequential trials in deterministic mode,
+    /// so that the stream of randomGenerator_ does not depend on the trials.
+    std::mt19937 trial_generator_;
+
+    inline TrialContext mainTrialContext() {
+        return TrialContext{MatchBaseType::options_.deterministic_trials ?
+                            trial_generator_ : MatchBaseType::randomGenerator_,
+                            base_3D_, -1};
+    }
+    inline TrialContext workerTrialContext(int id)
+    { return TrialContext{trial_workers_[id]->randomGenerator, trial_workers_[id]->base3D, id}; }
+
+    /// Reset the random generator to the stream of the given trial, when
+    /// running in deterministic mode.
+    inline void seedTrial(std::mt19937& generator, int trial) const {
+        if (! MatchBaseType::options_.deterministic_trials) return;
+        std::seed_seq seed {MatchBaseType::options_.randomSeed, (unsigned int)(trial)};
+        generator.seed(seed);
+    }
+
+    /// Rigid transformation quantized in SE(3), used as key of the
+    /// transformation cache
+    struct TransformationKey {
+        std::array<int, 8> coords;
+        inline bool operator== (const TransformationKey& other) const
+        { return coords == other.coords; }
+    };
+    struct TransformationKeyHash {
+        inline size_t operator() (const TransformationKey& key) const {
+            size_t h = 0;
+            for (int c : key.coords)
+                h ^= std::hash<int>()(c) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+    using TransformationCache =
+        std::unordered_map<TransformationKey, Scalar, TransformationKeyHash>;
+
+    /// LCP of the transformations verified so far. Partial LCP values (Verify
+    /// stopped early) are stored as well: they are lower than the best LCP at
+    /// the time of the verification, and thus cannot improve later on.
+    TransformationCache transformation_cache_;
+    size_t transformation_cache_hits_;
+    size_t transformation_cache_misses_;
+
+    /// Visitor call postponed until the end of the congruent set exploration
+    struct CandidateVisit {
+        int candidateId;
+        Scalar lcp;
+        MatrixType transform;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    /// Rigid transformation of a candidate of a congruent set, and its LCP
+    struct CandidateTransformation {
+        /// True if the candidate passes the rigid transformation test
+        bool congruent;
+        /// True if the LCP is read from transformation_cache_
+        bool cached;
+        /// Previous candidate of the set with the same quantized
+        /// transformation, whose LCP is reused, or -1
+        int source;
+        Scalar lcp;
+        TransformationKey key;
+        MatrixType transform;
+        /// Transformation given to the visitor
+        MatrixType visitTransform;
+        VectorType centroid2;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    /// Result of the exploration of a congruent set: its best candidate and
+    /// the visitor calls, applied to the shared state by CommitCongruentSet.
+    struct CongruentSetResult {
+        /// Best LCP of the set and index of the related candidate
+        Scalar lcp;
+        int candidateId;
+        /// Number of candidates passing the rigid transformation test
+        size_t nbCongruent;
+        CongruentBaseType congruent;
+        MatrixType transform;
+        VectorType centroid1;
+        VectorType centroid2;
+        std::vector<CandidateVisit, Eigen::aligned_allocator<CandidateVisit> > visits;
+        /// Transformations verified in the set, merged in the shared cache
+        TransformationCache cache;
+        /// Number of transformations read from (resp. added to) the cache
+        size_t cacheHits;
+        size_t cacheMisses;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
 #ifdef TEST_GLOBAL_TIMINGS
 
     mutable Scalar totalTime;
@@ -184,18 +401,52 @@ protected :
     /// else otherwise.
     bool TryOneBase(TransformVisitor &v);
 
+    /// Number of trials needed to draw, with a probability 1 - failure, at
+    /// least one base made of inliers when a fraction inlierRatio of the
+    /// points are inliers.
+    int ComputeNumberOfTrials(Scalar inlierRatio, Scalar failure) const;
+
     /// Loop over the set of congruent 4-points and test the compatibility with the
     /// input base.
     /// \param [out] Nb Number of quads corresponding to valid configurations
     bool TryCongruentSet(CongruentBaseType& base, Set& set, TransformVisitor &v,size_t &nbCongruent);
 
+    /// Verifies the congruent set using nbThreads threads, without modifying
+    /// the state of the matcher, so it can be called concurrently.
+    /// Only the candidates with a LCP greater than terminate_LCP are retained.
+    /// The candidates are verified by blocks of kVerifyBlockSize, stopping early
+    /// against the best LCP of the previous blocks, so the result does not
+    /// depend on the number of threads.
+    /// \param globalTransformation Compute the global transformation for the
+    /// buffered visitor calls
+    void ExploreCongruentSet(const CongruentBaseType& base, const Set& set,
+                             bool globalTransformation,
+                             Scalar terminate_LCP,
+                             int nbThreads,
+                             CongruentSetResult& result) const;
+
+    /// Calls the visitor for each candidate of an explored congruent set, and
+    /// retains its best candidate if it improves the current best LCP.
+    /// Returns true if the terminate threshold has been reached.
+    bool CommitCongruentSet(const CongruentBaseType& base,
+                            const CongruentSetResult& result,
+                            TransformVisitor &v);
+
     const CongruentBaseType& base3D() const { return base_3D_; }
 
     /// Find all the congruent set similar to the base in the second 3D model (Q).
     /// It could be with a 3 point base or a 4 point base.
+    /// Must only modify the state stored in the context, as trials can be
+    /// run concurrently using the context of each worker.
+    /// \param context random generator and base coordinates used by the trial.
     /// \param base use to find the similar points congruent in Q.
     /// \param congruent_set a set of all point congruent found in Q.
-    virtual bool generateCongruents (CongruentBaseType& base,Set& congruent_set) = 0;
+    virtual bool generateCongruents (TrialContext& context,
+                                     CongruentBaseType& base,
+                                     Set& congruent_set) = 0;
+
+    /// Quantizes a transformation computed between the centered clouds
+    TransformationKey QuantizeTransformation(const Eigen::Ref<const MatrixType>& mat) const;
 
     /// For each randomly picked base, verifies the computed transformation by
     /// computing the number of points that this transformation brings near points
@@ -203,6 +454,11 @@ protected :
     /// the translation vector and (cx,cy,cz) is the center of transformation.template <class MatrixDerived>
     Scalar Verify(const Eigen::Ref<const MatrixType> & mat) const;
 
+    /// Same as Verify(mat), but stops as soon as the transformation cannot
+    /// reach terminate_LCP instead of the current best LCP.
+    Scalar Verify(const Eigen::Ref<const MatrixType> & mat,
+                  Scalar terminate_LCP) const;
+
 }; /// class MatchBaseType
 } /// namespace Super4PCS
 #include "congruentSetExplorationBase.hpp"
@@ -3,6 +3,11 @@
 //
 
 #include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+#include <random>
 #include <atomic>
 #include <chrono>
 
@@ -33,10 +38,26 @@ template <typename Traits, typename TransformVisitor,
     , number_of_trials_(0)
     , best_LCP_(0.0)
     #ifdef OpenGR_USE_OPENMP
-    , omp_nthread_congruent_(1)
+    , omp_nthread_congruent_(options.nthread_congruent > 0 ? options.nthread_congruent
+                                                           : omp_get_max_threads())
     #endif
+    , transformation_cache_hits_(0)
+    , transformation_cache_misses_(0)
 //    , options_(options)
-{}
+{
+#ifdef OpenGR_USE_OPENMP
+    const int nbWorkers = options.nthread_trials > 0 ? options.nthread_trials
+                                                     : omp_get_max_threads();
+    if (nbWorkers > 1) {
+        // Each worker has its own random stream, derived from the seed
+        for (int i = 0; i != nbWorkers; ++i) {
+            std::seed_seq seed {options.randomSeed, (unsigned int)(i)};
+            trial_workers_.emplace_back(new TrialWorker);
+            trial_workers_.back()->randomGenerator.seed(seed);
+        }
+    }
+#endif
+}
 
 template <typename Traits, typename TransformVisitor,
           typename PairFilteringFunctor,
@@ -49,17 +70,15 @@ CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptE
 template <typename Traits, typename TransformVisitor,
           typename PairFilteringFunctor,
           template < class, class > class ... OptExts >
-template <typename Sampler>
+template <typename TargetType, typename Sampler>
 typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::Scalar
-CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::ComputeTransformation(
-        const std::vector<Point3D>& P,
+CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::ComputeTransformationImpl(
+        const TargetType& P,
         const std::vector<Point3D>& Q,
         Eigen::Ref<typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> transformation,
         const Sampler& sampler,
         TransformVisitor& v) {
   const Scalar kSmallError = 0.00001;
-  const int kMinNumberOfTrials = 4;
-  const Scalar kDiameterFraction = 0.3;
 
 #ifdef TEST_GLOBAL_TIMINGS
     kdTreeTime = 0;
@@ -69,19 +88,6 @@ CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptE
 
   if (P.empty() || Q.empty()) return kLargeNumber;
 
-  // RANSAC probability and number of needed trials.
-  Scalar first_estimation =
-          std::log(kSmallError) / std::log(1.0 - pow(MatchBaseType::options_.getOverlapEstimation(),
-                                                     static_cast<Scalar>(kMinNumberOfTrials)));
-  // We use a simple heuristic to elevate the probability to a reasonable value
-  // given that we don't simply sample from P, but instead, we bound the
-  // distance between the points in the base as a fraction of the diameter.
-  number_of_trials_ =
-          static_cast<int>(first_estimation * (MatchBaseType::P_diameter_ / kDiameterFraction) /
-                           MatchBaseType::max_base_diameter_);
-  if (number_of_trials_ < kMinNumberOfTrials)
-      number_of_trials_ = kMinNumberOfTrials;
-
   MatchBaseType::template Log<LogLevel::Verbose>( "norm_max_dist: ", MatchBaseType::options_.delta );
   current_trial_ = 0;
   best_LCP_ = 0.0;
@@ -93,6 +99,28 @@ CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptE
 
   MatchBaseType::init(P, Q, sampler);
 
+  // RANSAC probability and number of needed trials. The diameters used by
+  // the estimation are computed by init.
+  number_of_trials_ = ComputeNumberOfTrials(MatchBaseType::options_.getOverlapEstimation(),
+                                            kSmallError);
+
+  const auto& sampled_Q = MatchBaseType::sampled_Q_3D_;
+  std::vector<size_t> order (sampled_Q.size());
+  std::iota(order.begin(), order.end(), 0);
+  if (MatchBaseType::options_.use_sprt_verification) {
+      // The SPRT decides on a prefix of Q, which must be a random subset.
+      // A dedicated generator is used to keep the bases selection unchanged.
+      std::mt19937 generator (MatchBaseType::options_.randomSeed);
+      std::shuffle(order.begin(), order.end(), generator);
+  }
+  sampled_Q_3D_soa_.resize(sampled_Q.size(), 3);
+  for (size_t i = 0; i < sampled_Q.size(); ++i)
+      sampled_Q_3D_soa_.row(i) = sampled_Q[order[i]].pos().transpose().array();
+
+  transformation_cache_.clear();
+  transformation_cache_hits_   = 0;
+  transformation_cache_misses_ = 0;
+
   best_LCP_ = Verify(MatchBaseType::transform_);
   MatchBaseType::template Log<LogLevel::Verbose>( "Initial LCP: ", best_LCP_ );
 
@@ -120,8 +148,6 @@ CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptE
         int n,
         Eigen::Ref<typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> transformation,
         TransformVisitor &v) {
-  using std::chrono::system_clock;
-
 #ifdef TEST_GLOBAL_TIMINGS
     Timer t (true);
 #endif
@@ -141,16 +167,19 @@ CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptE
   v(0, best_LCP_, transformation);
 
   bool ok = false;
-  std::chrono::time_point<system_clock> t0 = system_clock::now(), end;
-  for (int i = current_trial_; i < current_trial_ + n; ++i) {
-    ok = TryOneBase(v);
+  const Utils::Deadline& deadline = MatchBaseType::deadline_;
+
+  // Report the progress after the trial i, and returns true if the process
+  // must be stopped
+  auto endTrial = [&](int i, bool trialOk) {
+    // Adaptive RANSAC: the best LCP is a lower bound of the inlier ratio
+    if (MatchBaseType::options_.use_adaptive_trials && best_LCP_ > Scalar(0))
+      number_of_trials_ = std::min(number_of_trials_, ComputeNumberOfTrials(
+              best_LCP_, Scalar(1) - MatchBaseType::options_.adaptive_trials_confidence));
 
     Scalar fraction_try  = Scalar(i) / Scalar(number_of_trials_);
-    Scalar fraction_time =
-        std::chrono::duration_cast<std::chrono::seconds>
-        (system_clock::now() - t0).count() /
-                          MatchBaseType::options_.max_time_seconds;
-    Scalar fraction = std::max(fraction_time, fraction_try);
+    Scalar fraction_time = Scalar(deadline.elapsedFraction());
+    Scalar fraction = std::min(Scalar(1), std::max(fraction_time, fraction_try));
 
     if (v.needsGlobalTransformation()) {
       getGlobalTransform(transformation);
@@ -161,8 +190,96 @@ CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptE
     v(fraction, best_LCP_, transformation);
 
     // ok means that we already have the desired LCP.
-    if (ok || i > number_of_trials_ || fraction >= 0.99 || best_LCP_ == 1.0) break;
+    return trialOk || i > number_of_trials_ || fraction >= 0.99 || best_LCP_ == 1.0 ||
+           deadline.expired();
+  };
+
+  if (trial_workers_.empty()) {
+    for (int i = current_trial_; i < current_trial_ + n; ++i) {
+      seedTrial(trial_generator_, i);
+      ok = TryOneBase(v);
+      if (endTrial(i, ok)) break;
+    }
+  }
+#ifdef OpenGR_USE_OPENMP
+  else {
+    // The trials are run by rounds. Within a round, each worker explores
+    // trials using its own context, without modifying the matcher state. The
+    // best LCP is shared between the workers for early termination. The
+    // results are then committed sequentially, in the trial order.
+    //
+    // In deterministic mode, the trials are only terminated early using the
+    // LCP committed before the round, ie. from trials with a lower index, so
+    // a candidate cannot be discarded in favor of an equivalent one found by
+    // a later trial.
+    //
+    // A trial reaching the terminate threshold, or skipped because of the
+    // deadline, only cancels the trials with a higher index. The trials with a
+    // lower index are run and committed whatever the schedule, as they would
+    // be by the sequential loop.
+    struct TrialResult {
+      bool valid;
+      CongruentBaseType base;
+      CongruentSetResult result;
+    };
+    const int nbWorkers = int(trial_workers_.size());
+    const int roundSize = kTrialsPerWorkerAndRound * nbWorkers;
+    const Scalar terminate = MatchBaseType::options_.getTerminateThreshold();
+    const bool globalTransformation = v.needsGlobalTransformation();
+    const bool deterministic = MatchBaseType::options_.deterministic_trials;
+    std::vector<TrialResult, Eigen::aligned_allocator<TrialResult> > results (roundSize);
+
+    bool stop = false;
+    for (int first = current_trial_; first < current_trial_ + n && !stop; first += roundSize) {
+      const int nbTrials = std::min(roundSize, current_trial_ + n - first);
+      std::atomic<Scalar> shared_best_LCP (best_LCP_);
+      // Index of the last trial of the round to run and commit
+      std::atomic<int>    lastTrial (nbTrials - 1);
+      auto cancelAfter = [&lastTrial](int k) {
+        int current = lastTrial;
+        while (k < current && ! lastTrial.compare_exchange_weak(current, k)) {}
+      };
+
+#pragma omp parallel for schedule(dynamic) num_threads(nbWorkers)
+      for (int k = 0; k < nbTrials; ++k) {
+        TrialResult& trial = results[k];
+        trial.valid = false;
+        if (k > lastTrial) continue;
+        if (deadline.expired()) {
+          cancelAfter(k - 1);
+          continue;
+        }
+
+        TrialContext context = workerTrialContext(omp_get_thread_num());
+        seedTrial(context.randomGenerator, first + k);
+        Set congruent_set;
+        if (! generateCongruents(context, trial.base, congruent_set)) continue;
+
+        ExploreCongruentSet(trial.base, congruent_set, globalTransformation,
+                            deterministic ? best_LCP_ : Scalar(shared_best_LCP),
+                            1, trial.result);
+        trial.valid = true;
+
+        if (trial.result.candidateId >= 0) {
+          Scalar current = shared_best_LCP;
+          while (trial.result.lcp > current &&
+                 ! shared_best_LCP.compare_exchange_weak(current, trial.result.lcp)) {}
+          if (trial.result.lcp > terminate) cancelAfter(k);
+        }
+      }
+
+      const int nbCommitted = lastTrial + 1;
+      for (int k = 0; k < nbCommitted; ++k) {
+        ok = results[k].valid && CommitCongruentSet(results[k].base, results[k].result, v);
+        if (endTrial(first + k, ok)) {
+          stop = true;
+          break;
+        }
+      }
+      if (nbCommitted != nbTrials) stop = true;
+    }
   }
+#endif
 
   // Need to force global transformation update at the end of the process
   // if not already performed for the visitor during the process
@@ -186,7 +303,8 @@ bool CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor,
         TransformVisitor &v) {
         CongruentBaseType base;
         Set congruent_quads;
-        if (!generateCongruents(base,congruent_quads))
+        TrialContext context = mainTrialContext();
+        if (!generateCongruents(context,base,congruent_quads))
             return false;
 
         size_t nb = 0;
@@ -199,6 +317,24 @@ bool CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor,
         return match;
 }
 
+template <typename Traits, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+int CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::ComputeNumberOfTrials(
+        Scalar inlierRatio, Scalar failure) const {
+    const double estimation =
+            std::log(double(failure)) /
+            std::log(1.0 - std::pow(double(inlierRatio), double(Traits::size())));
+    // We use a simple heuristic to elevate the probability to a reasonable value
+    // given that we don't simply sample from P, but instead, we bound the
+    // distance between the points in the base as a fraction of the diameter.
+    const double trials = estimation * (MatchBaseType::P_diameter_ / kDiameterFraction) /
+                          MatchBaseType::max_base_diameter_;
+    if (! (trials > double(kMinNumberOfTrials))) return kMinNumberOfTrials;
+    return trials < double(std::numeric_limits<int>::max() / 2) ?
+                int(trials) : std::numeric_limits<int>::max() / 2;
+}
+
 template <typename Traits, typename TransformVisitor,
           typename PairFilteringFunctor,
           template < class, class > class ... OptExts >
@@ -207,8 +343,27 @@ bool CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor,
         typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::Set& set,
         TransformVisitor &v,
         size_t &nbCongruent) {
-    static const Scalar pi = std::acos(-1);
+#ifdef OpenGR_USE_OPENMP
+    const int nbThreads = omp_nthread_congruent_;
+#else
+    const int nbThreads = 1;
+#endif
+    CongruentSetResult result;
+    ExploreCongruentSet(base, set, v.needsGlobalTransformation(), best_LCP_, nbThreads, result);
+    nbCongruent = result.nbCongruent;
+    return CommitCongruentSet(base, result, v);
+}
 
+template <typename Traits, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+void CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::ExploreCongruentSet(
+        const typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::CongruentBaseType& base,
+        const typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::Set& set,
+        bool globalTransformation,
+        Scalar terminate_LCP,
+        int nbThreads,
+        typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::CongruentSetResult& result) const {
     // get references to the basis coordinate
     Coordinates references;
 //    std::cout << "Process congruent set for base: \n";
@@ -217,143 +372,242 @@ bool CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor,
 //        std::cout << "[" << base[i] << "]: " << references[i].pos().transpose() << "\n";
     }
     const Coordinates& ref = references;
-    Scalar targetAngle = (references[1].pos() - references[0].pos()).normalized().dot(
-          (references[3].pos() - references[2].pos()).normalized());
-//    std::cout << "Target Angle : " << std::acos(targetAngle)*Scalar(180)/pi << std::endl;
 
     // Centroid of the basis, computed once and using only the three first points
     Eigen::Matrix<Scalar, 3, 1> centroid1 = (ref[0].pos() + ref[1].pos() + ref[2].pos()) / Scalar(3);
 
 //    std::cout << "Congruent set size: " << set.size() <<  std::endl;
 
-    std::atomic<size_t> nbCongruentAto(0);
+#ifndef OpenGR_USE_OPENMP
+    nbThreads = 1;
+#endif
+
+    // The candidates are processed by blocks of kVerifyBlockSize, so that the
+    // result does not depend on the number of threads nor on their scheduling:
+    //  1. the rigid transformations of the block are computed in parallel,
+    //  2. the candidates whose transformation is in the cache, or shares its
+    //     quantized value with a previous candidate, are resolved in order,
+    //  3. the other transformations are verified in parallel, stopping early
+    //     against the best LCP of the previous blocks,
+    //  4. the visitor calls and the best candidate are collected in order,
+    //     the first candidate being retained among equal LCPs.
+    const int nbCandidates = int(set.size());
+    std::vector<CandidateTransformation, Eigen::aligned_allocator<CandidateTransformation> >
+            candidates (std::min(nbCandidates, int(kVerifyBlockSize)));
+    std::unordered_map<TransformationKey, int, TransformationKeyHash> blockCandidates;
+    const bool useCache = MatchBaseType::options_.use_transformation_cache &&
+                          ! MatchBaseType::options_.deterministic_trials;
+    const Utils::Deadline& deadline = MatchBaseType::deadline_;
+
+    result.lcp         = terminate_LCP;
+    result.candidateId = -1;
+    result.nbCongruent = 0;
+    result.cacheHits   = 0;
+    result.visits.clear();
+    result.cache.clear();
+    for (int begin = 0; begin < nbCandidates; begin += kVerifyBlockSize) {
+        // The remaining candidates are skipped once the deadline is passed
+        if (deadline.expired()) break;
+        const int blockSize = std::min(int(kVerifyBlockSize), nbCandidates - begin);
+        const Scalar blockLCP = result.lcp;
 
-    Coordinates congruent_candidate;
 #ifdef OpenGR_USE_OPENMP
-#pragma omp parallel for num_threads(omp_nthread_congruent_)
+#pragma omp parallel for schedule(dynamic) num_threads(nbThreads) if(nbThreads > 1)
 #endif
-    for (int i = 0; i < int(set.size()); ++i) {
-        const auto& congruent_ids = set[i];
-        for (int j = 0; j!= Traits::size(); ++j)
-            congruent_candidate[j] = MatchBaseType::sampled_Q_3D_[congruent_ids[j]];
+        for (int c = 0; c < blockSize; ++c) {
+            const int i = begin + c;
+            CandidateTransformation& candidate = candidates[c];
+            candidate.congruent = false;
+            if (deadline.expired()) continue;
 
-        Eigen::Matrix<Scalar, 4, 4> transform;
+            const auto& congruent_ids = set[i];
+            Coordinates congruent_candidate;
+            for (int j = 0; j!= Traits::size(); ++j)
+                congruent_candidate[j] = MatchBaseType::sampled_Q_3D_[congruent_ids[j]];
 
-        // Centroid of the sets, computed in the loop using only the three first points
-        Eigen::Matrix<Scalar, 3, 1> centroid2;
+            Eigen::Matrix<Scalar, 4, 4> transform;
+
+            // Centroid of the sets, computed in the loop using only the three first points
+            Eigen::Matrix<Scalar, 3, 1> centroid2;
 
 
 #ifdef STATIC_BASE
-        MatchBaseType::Log<LogLevel::Verbose>( "Ids: ");
-        for (int j = 0; j!= Traits::size(); ++j)
-            MatchBaseType::Log<LogLevel::Verbose>( base[j], "\t");
-        MatchBaseType::Log<LogLevel::Verbose>( "     ");
-        for (int j = 0; j!= Traits::size(); ++j)
-            MatchBaseType::Log<LogLevel::Verbose>( congruent_ids[j], "\t");
+            MatchBaseType::Log<LogLevel::Verbose>( "Ids: ");
+            for (int j = 0; j!= Traits::size(); ++j)
+                MatchBaseType::Log<LogLevel::Verbose>( base[j], "\t");
+            MatchBaseType::Log<LogLevel::Verbose>( "     ");
+            for (int j = 0; j!= Traits::size(); ++j)
+                MatchBaseType::Log<LogLevel::Verbose>( congruent_ids[j], "\t");
 #endif
 
-        centroid2 = (congruent_candidate[0].pos() +
-                congruent_candidate[1].pos() +
-                congruent_candidate[2].pos()) / Scalar(3.);
-
-        Scalar rms = -1;
-
-        const bool ok =
-                this->ComputeRigidTransformation(ref,     // input congruent quad
-                                           congruent_candidate,// tested congruent quad
-                                           centroid1,          // input: basis centroid
-                                           centroid2,          // input: candidate quad centroid
-                                           transform,          // output: transformation
-                                           rms,                // output: rms error of the transformation between the basis and the congruent quad
-                                   #ifdef MULTISCALE
-                                           true
-                                   #else
-                                           false
-                                   #endif
-                                           );             // state: compute scale ratio ?
-
-        if (ok && rms >= Scalar(0.)) {
+            centroid2 = (congruent_candidate[0].pos() +
+                    congruent_candidate[1].pos() +
+                    congruent_candidate[2].pos()) / Scalar(3.);
+
+            Scalar rms = -1;
+
+            const bool ok =
+                    this->ComputeRigidTransformation(ref,     // input congruent quad
+                                               congruent_candidate,// tested congruent quad
+                                               centroid1,          // input: basis centroid
+                                               centroid2,          // input: candidate quad centroid
+                                               transform,          // output: transformation
+                                               rms,                // output: rms error of the transformation between the basis and the congruent quad
+                                       #ifdef MULTISCALE
+                                               true
+                                       #else
+                                               false
+                                       #endif
+                                               );             // state: compute scale ratio ?
 
             // We give more tolerant in computing the best rigid transformation.
-            if (rms < distance_factor * MatchBaseType::options_.delta) {
-
-//                std::cout << "congruent candidate: [";
-//                for (int j = 0; j!= Traits::size(); ++j)
-//                    std::cout << congruent_ids[j] << " ";
-//                std::cout << "]";
-
-                nbCongruentAto++;
+            if (ok && rms >= Scalar(0.) && rms < distance_factor * MatchBaseType::options_.delta) {
                 // The transformation is computed from the point-clouds centered inn [0,0,0]
-
-                // Verify the rest of the points in Q against P.
-                Scalar lcp = Verify(transform);
-//                std::cout << " " << lcp << " - Angle: ";
-
-                // compute angle between pairs of points: for debug only
-//                Scalar angle = (congruent_candidate[1].pos() - congruent_candidate[0].pos()).normalized().dot(
-//                      (congruent_candidate[3].pos() - congruent_candidate[2].pos()).normalized());
-//                std::cout << std::acos(angle)*Scalar(180)/pi << " (error: "
-//                          << (std::acos(targetAngle) - std::acos(angle))*Scalar(180)/pi << ")\n";
+                candidate.congruent = true;
+                candidate.cached    = false;
+                candidate.source    = -1;
+                candidate.transform = transform;
+                candidate.centroid2 = centroid2;
+                if (useCache)
+                    candidate.key = QuantizeTransformation(transform);
 
                 // transformation has been computed between the two point clouds centered
                 // at the origin, we need to recompute the translation to apply it to the original clouds
-#pragma omp critical
+                candidate.visitTransform = transform;
+                if (globalTransformation)
                 {
-                  auto getGlobalTransform =
-                      [this, transform, centroid1, centroid2]
-                      (Eigen::Ref<MatrixType> transformation){
-                      Eigen::Matrix<Scalar, 3, 3> rot, scale;
-                      Eigen::Transform<Scalar, 3, Eigen::Affine> (transform).computeRotationScaling(&rot, &scale);
-                      transformation = transform;
-                      transformation.col(3) = (centroid1 + MatchBaseType::centroid_P_ -
-                                               ( rot * scale * (centroid2 + MatchBaseType::centroid_Q_))).homogeneous();
-                    };
-
-                  if (v.needsGlobalTransformation())
-                    {
-                      Eigen::Matrix<Scalar, 4, 4> transformation = transform;
-                      getGlobalTransform(transformation);
-                      v(-1, lcp, transformation);
-                    }
-                  else
-                    v(-1, lcp, transform);
-
-                  if (lcp > best_LCP_) {
-                      // Retain the best LCP and transformation.
-                      for (int j = 0; j!= Traits::size(); ++j)
-                        base_[j] = base[j];
-
+                    Eigen::Matrix<Scalar, 3, 3> rot, scale;
+                    Eigen::Transform<Scalar, 3, Eigen::Affine> (transform).computeRotationScaling(&rot, &scale);
+                    candidate.visitTransform.col(3) = (centroid1 + MatchBaseType::centroid_P_ -
+                                                       ( rot * scale * (centroid2 + MatchBaseType::centroid_Q_))).homogeneous();
+                }
+            }
 
-                      for (int j = 0; j!= Traits::size(); ++j)
-                        current_congruent_[j] = congruent_ids[j];
+        }
 
-                      best_LCP_                   = lcp;
-                      MatchBaseType::transform_   = transform;
-                      MatchBaseType::qcentroid1_  = centroid1;
-                      MatchBaseType::qcentroid2_  = centroid2;
+        // Look for a similar transformation in the cache, or earlier in the
+        // set. The shared cache is only read here, and the verified
+        // transformations are added to it by CommitCongruentSet.
+        if (useCache) {
+            blockCandidates.clear();
+            for (int c = 0; c < blockSize; ++c) {
+                CandidateTransformation& candidate = candidates[c];
+                if (! candidate.congruent) continue;
+                auto it = transformation_cache_.find(candidate.key);
+                if (it == transformation_cache_.end()) {
+                    it = result.cache.find(candidate.key);
+                    if (it == result.cache.end()) {
+                        auto first = blockCandidates.emplace(candidate.key, c);
+                        if (first.second) continue;
+                        candidate.source = first.first->second;
+                        result.cacheHits++;
+                        continue;
                     }
-
                 }
-                // Terminate if we have the desired LCP already.
-                if (lcp > MatchBaseType::options_.getTerminateThreshold()){
-                    continue;
-                  }
+                candidate.lcp    = it->second;
+                candidate.cached = true;
+                result.cacheHits++;
             }
-          } else {
+        }
 
-//            std::cout << "skipped candidate: [";
-//            for (int j = 0; j!= Traits::size(); ++j)
-//                std::cout << congruent_ids[j] << " ";
-//            std::cout << "]\n";
-          }
+        // Verify the rest of the points in Q against P
+#ifdef OpenGR_USE_OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nbThreads) if(nbThreads > 1)
+#endif
+        for (int c = 0; c < blockSize; ++c) {
+            CandidateTransformation& candidate = candidates[c];
+            if (candidate.congruent && ! candidate.cached && candidate.source < 0)
+                candidate.lcp = deadline.expired() ? Scalar(0)
+                                                   : Verify(candidate.transform, blockLCP);
+        }
+
+        for (int c = 0; c < blockSize; ++c) {
+            const int i = begin + c;
+            CandidateTransformation& candidate = candidates[c];
+            if (! candidate.congruent) continue;
+            result.nbCongruent++;
+
+            if (candidate.source >= 0)
+                candidate.lcp = candidates[candidate.source].lcp;
+            else if (useCache && ! candidate.cached)
+                result.cache.emplace(candidate.key, candidate.lcp);
+
+            CandidateVisit visit;
+            visit.candidateId = i;
+            visit.lcp         = candidate.lcp;
+            visit.transform   = candidate.visitTransform;
+            result.visits.push_back(visit);
+
+            if (candidate.lcp > result.lcp) {
+                // Retain the best LCP and transformation of the set.
+                result.lcp         = candidate.lcp;
+                result.candidateId = i;
+                result.congruent   = set[i];
+                result.transform   = candidate.transform;
+                result.centroid1   = centroid1;
+                result.centroid2   = candidate.centroid2;
+            }
+        }
     }
+    result.cacheMisses = result.cache.size();
+}
 
-    nbCongruent = nbCongruentAto;
+
+template <typename Traits, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+bool CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::CommitCongruentSet(
+        const typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::CongruentBaseType& base,
+        const typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::CongruentSetResult& result,
+        TransformVisitor &v) {
+    for (const auto& visit : result.visits)
+        v(-1, visit.lcp, visit.transform);
+
+    transformation_cache_hits_   += result.cacheHits;
+    transformation_cache_misses_ += result.cacheMisses;
+    transformation_cache_.insert(result.cache.begin(), result.cache.end());
+
+    if (result.candidateId >= 0 && result.lcp > best_LCP_) {
+        // Retain the best LCP and transformation.
+        for (int j = 0; j!= Traits::size(); ++j)
+          base_[j] = base[j];
+
+        current_congruent_          = result.congruent;
+        best_LCP_                   = result.lcp;
+        MatchBaseType::transform_   = result.transform;
+        MatchBaseType::qcentroid1_  = result.centroid1;
+        MatchBaseType::qcentroid2_  = result.centroid2;
+    }
 
     // If we reached here we do not have yet the desired LCP.
     return best_LCP_ > MatchBaseType::options_.getTerminateThreshold() /*false*/;
 }
 
+template <typename Traits, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::TransformationKey
+CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::QuantizeTransformation(
+        const Eigen::Ref<const typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> &mat) const {
+    const Scalar rotationStep    = MatchBaseType::options_.transformation_cache_rotation_step;
+    const Scalar translationStep = MatchBaseType::options_.delta;
+
+    Eigen::Matrix<Scalar, 3, 3> rot = mat.template topLeftCorner<3,3>();
+    const Scalar scale = rot.col(0).norm();
+    rot /= scale;
+
+    // q and -q represent the same rotation
+    Eigen::Quaternion<Scalar> q (rot);
+    if (q.w() < Scalar(0)) q.coeffs() *= Scalar(-1);
+
+    TransformationKey key;
+    for (int i = 0; i != 4; ++i)
+        key.coords[i]   = int(std::floor(q.coeffs()(i) / rotationStep));
+    for (int i = 0; i != 3; ++i)
+        key.coords[4+i] = int(std::floor(mat(i,3) / translationStep));
+    key.coords[7] = int(std::floor(scale / rotationStep));
+    return key;
+}
 
 // Verify a given transformation by computing the number of points in P at
 // distance at most (normalized) delta from some point in Q. In the paper
@@ -365,6 +619,16 @@ template <typename Traits, typename TransformVisitor,
 typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::Scalar
 CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::Verify(
         const Eigen::Ref<const typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> &mat) const {
+    return Verify(mat, best_LCP_);
+}
+
+template <typename Traits, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::Scalar
+CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::Verify(
+        const Eigen::Ref<const typename CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> &mat,
+        Scalar terminate_LCP) const {
     using RangeQuery = typename gr::KdTree<Scalar>::template RangeQuery<>;
 
 #ifdef TEST_GLOBAL_TIMINGS
@@ -374,7 +638,7 @@ CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptE
     // We allow factor 2 scaling in the normalization.
     const Scalar epsilon = MatchBaseType::options_.delta;
 #ifdef OPENGR_USE_WEIGHTED_LCP
-    std::atomic<float> good_points(0);
+    Scalar good_points(0);
 
     auto kernel = [](Scalar x) {
         return std::pow(std::pow(x,4) - Scalar(1), 2);
@@ -384,56 +648,121 @@ CongruentSetExplorationBase<Traits, TransformVisitor, PairFilteringFunctor, OptE
         return kernel( std::sqrt(sqx) / th );
     };
 #else
-    std::atomic_uint good_points(0);
+    size_t good_points(0);
 #endif
     const size_t number_of_points = MatchBaseType::sampled_Q_3D_.size();
-    const size_t terminate_value = best_LCP_ * number_of_points;
+    const size_t terminate_value = terminate_LCP * number_of_points;
 
     const Scalar sq_eps = epsilon*epsilon;
 #ifdef OPENGR_USE_WEIGHTED_LCP
     const Scalar    eps = std::sqrt(sq_eps);
 #endif
 
-    for (size_t i = 0; i < number_of_points; ++i) {
+    // Points of Q transformed by mat, one column per dimension. The storage is
+    // allocated on the stack, and the transformation is vectorized by Eigen.
+    Eigen::Array<Scalar, Eigen::Dynamic, 3, Eigen::ColMajor, kVerifyBatchSize, 3> batch;
+
+    // Sequential probability ratio test: the transformation is rejected when
+    // the likelihood ratio between the hypotheses "the LCP is sprt_bad_ratio
+    // times the target LCP" and "the LCP reaches the target LCP" goes above
+    // 1/sprt_false_rejection. Each inlier (resp. outlier) adds logInlier
+    // (resp. logOutlier) to the log of the ratio.
+    const auto& options  = MatchBaseType::options_;
+    const bool  useSprt  = options.use_sprt_verification &&
+                           ! options.deterministic_trials &&
+                           terminate_LCP > Scalar(0) && terminate_LCP < Scalar(1);
+    Scalar logInlier = 0, logOutlier = 0, logThreshold = 0, logLambda = 0;
+    if (useSprt) {
+        const Scalar goodRatio = terminate_LCP;
+        const Scalar badRatio  = terminate_LCP * options.sprt_bad_ratio;
+        logInlier    = std::log(badRatio / goodRatio);
+        logOutlier   = std::log((Scalar(1) - badRatio) / (Scalar(1) - goodRatio));
+        logThreshold = -std::log(options.sprt_false_rejection);
+    }
 
-        // Use the kdtree to get the nearest neighbor
+    using Grid = OccupancyGrid<Scalar>;
+    const Grid& grid    = MatchBaseType::occupancy_grid_;
+    const bool  useGrid = ! grid.empty();
+
+    Scalar previous_good_points (0);
+    bool stop = false;
+    for (size_t start = 0; start < number_of_points && !stop; start += kVerifyBatchSize) {
+        const Eigen::Index batchSize =
+                Eigen::Index(std::min(size_t(kVerifyBatchSize), number_of_points - start));
+        const auto in = sampled_Q_3D_soa_.middleRows(start, batchSize);
+        batch.resize(batchSize, 3);
+        for (int d = 0; d != 3; ++d)
+            batch.col(d) = mat(d,0) * in.col(0) + mat(d,1) * in.col(1)
+                         + mat(d,2) * in.col(2) + mat(d,3);
+
+        for (Eigen::Index k = 0; k != batchSize; ++k) {
+            const size_t i = start + k;
+
+            const VectorType p = batch.row(k).transpose().matrix();
+
+            // The occupancy grid tells if p is for sure inside or outside of the
+            // dilated P. Otherwise, or when the distance is needed to weight
+            // the LCP, use the kdtree to get the nearest neighbor
+            const auto cell = useGrid ? grid.classify(p) : Grid::BORDER;
+
+            if (cell == Grid::EMPTY) {
+                // no point of P within the distance threshold
+            }
+#ifndef OPENGR_USE_WEIGHTED_LCP
+            else if (cell == Grid::FULL) {
+                good_points++;
+            }
+#endif
+            else {
 #ifdef TEST_GLOBAL_TIMINGS
-        Timer t (true);
+                Timer t (true);
 #endif
 
-        RangeQuery query;
-        query.queryPoint = (mat * MatchBaseType::sampled_Q_3D_[i].pos().homogeneous()).template head<3>();
-        query.sqdist     = sq_eps;
+                RangeQuery query;
+                query.queryPoint = p;
+                query.sqdist     = sq_eps;
 
-        auto result = MatchBaseType::kd_tree_.doQueryRestrictedClosestIndex( query );
+#ifdef OPENGR_USE_WEIGHTED_LCP
+                auto result = MatchBaseType::kd_tree_.doQueryRestrictedClosestIndex( query );
+                const bool found = result.first != gr::KdTree<Scalar>::invalidIndex();
+#else
+                // the closest point is not needed, only its existence
+                const bool found = MatchBaseType::kd_tree_.doQueryFirstHitIndex( query )
+                                   != gr::KdTree<Scalar>::invalidIndex();
+#endif
 
 #ifdef TEST_GLOBAL_TIMINGS
-        kdTreeTime += Scalar(t.elapsed().count()) / Scalar(CLOCKS_PER_SEC);
+                kdTreeTime += Scalar(t.elapsed().count()) / Scalar(CLOCKS_PER_SEC);
 #endif
 
-        if ( result.first != gr::KdTree<Scalar>::invalidIndex() ) {
-            //      Point3D& q = sampled_P_3D_[near_neighbor_index[0]];
-            //      bool rgb_good =
-            //          (p.rgb()[0] >= 0 && q.rgb()[0] >= 0)
-            //              ? cv::norm(p.rgb() - q.rgb()) < options_.max_color_distance
-            //              : true;
-            //      bool norm_good = norm(p.normal()) > 0 && norm(q.normal()) > 0
-            //                           ? fabs(p.normal().ddot(q.normal())) >= cos_dist
-            //                           : true;
-            //      if (rgb_good && norm_good) {
+                if ( found ) {
 #ifdef OPENGR_USE_WEIGHTED_LCP
-            assert (result.second <= query.sqdist);
-            good_points = good_points + computeWeight(result.second, eps);
+                    assert (result.second <= query.sqdist);
+                    good_points += computeWeight(result.second, eps);
 #else
-            good_points++;
+                    good_points++;
 #endif
-            //      }
-        }
+                }
+            }
+
+            // We can terminate if there is no longer chance to get better than the
+            // current best LCP.
+            if (number_of_points - i + good_points < terminate_value) {
+                stop = true;
+                break;
+            }
 
-        // We can terminate if there is no longer chance to get better than the
-        // current best LCP.
-        if (number_of_points - i + good_points < terminate_value) {
-            break;
+            // Or if the SPRT says it is unlikely, as long as the partial count
+            // is low enough to never be retained as the best LCP.
+            if (useSprt) {
+                const Scalar inlier = Scalar(good_points) - previous_good_points;
+                previous_good_points = Scalar(good_points);
+                logLambda += inlier * logInlier + (Scalar(1) - inlier) * logOutlier;
+                if (logLambda > logThreshold && good_points < terminate_value) {
+                    stop = true;
+                    break;
+                }
+            }
         }
     }
 
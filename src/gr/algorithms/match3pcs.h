@@ -51,7 +51,8 @@ namespace gr {
         /// It could be with a 3 point base or a 4 point base.
         /// \param base use to find the similar points congruent in Q.
         /// \param congruent_set a set of all point congruent found in Q.
-        bool generateCongruents (CongruentBaseType& base, Set& congruent_quads) override;
+        bool generateCongruents (typename MatchBaseType::TrialContext& context,
+                                 CongruentBaseType& base, Set& congruent_quads) override;
 
         /// Initializes the data structures and needed values before the match
         /// computation.
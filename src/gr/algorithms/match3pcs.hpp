@@ -30,20 +30,22 @@ namespace gr {
     template <typename TransformVisitor,
               typename PairFilteringFunctor,
               template < class, class > typename PFO>
-    bool Match3pcs<TransformVisitor, PairFilteringFunctor, PFO>::generateCongruents (CongruentBaseType &base, Set& congruent_set) {
+    bool Match3pcs<TransformVisitor, PairFilteringFunctor, PFO>::generateCongruents (
+        typename MatchBaseType::TrialContext& context, CongruentBaseType &base, Set& congruent_set) {
 
         //Find base in P (random triangle)
-        if (!MatchBaseType::SelectRandomTriangle(base[0], base[1], base[2]))
+        if (!MatchBaseType::SelectRandomTriangle(context.randomGenerator, base[0], base[1], base[2]))
             return false;
-        MatchBaseType::base_3D_ [0] = MatchBaseType::sampled_P_3D_[base[0]];
-        MatchBaseType::base_3D_ [1] = MatchBaseType::sampled_P_3D_[base[1]];
-        MatchBaseType::base_3D_ [2] = MatchBaseType::sampled_P_3D_[base[2]];
+        Coordinates& base_3D = context.base3D;
+        base_3D [0] = MatchBaseType::sampled_P_3D_[base[0]];
+        base_3D [1] = MatchBaseType::sampled_P_3D_[base[1]];
+        base_3D [2] = MatchBaseType::sampled_P_3D_[base[2]];
 
 
         // Computes distance between points.
-        const Scalar d1 = (MatchBaseType::base_3D_[0].pos()- MatchBaseType::base_3D_[1].pos()).norm();
-        const Scalar d2 = (MatchBaseType::base_3D_[0].pos()- MatchBaseType::base_3D_[2].pos()).norm();
-        const Scalar d3 = (MatchBaseType::base_3D_[1].pos()- MatchBaseType::base_3D_[2].pos()).norm();
+        const Scalar d1 = (base_3D[0].pos()- base_3D[1].pos()).norm();
+        const Scalar d2 = (base_3D[0].pos()- base_3D[2].pos()).norm();
+        const Scalar d3 = (base_3D[1].pos()- base_3D[2].pos()).norm();
 
        /*
         // Compute normal angles.
@@ -56,6 +58,7 @@ namespace gr {
 
         // Find all 3pcs in Q
         for (int i=0; i<MatchBaseType::sampled_Q_3D_.size(); ++i) {
+            if (MatchBaseType::deadline_.expired()) break;
             const Point3D& a = MatchBaseType::sampled_Q_3D_[i];
             for (int j=i+1; j<MatchBaseType::sampled_Q_3D_.size(); ++j) {
                 const Point3D& b = MatchBaseType::sampled_Q_3D_[j];
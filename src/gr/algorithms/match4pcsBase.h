@@ -30,8 +30,34 @@ namespace gr {
         using Coordinates = std::array<Point3D, 4>;
     };
 
+    /// Pairs of points of Q to extract for a pair of points of the base.
+    /// Several queries can be processed by a single call to the ExtractPairs
+    /// functions of the 4PCS functors.
+    struct PairExtractionQuery {
+        using Scalar = typename Point3D::Scalar;
+        /// Distance between the two points of the base
+        Scalar pair_distance;
+        /// Angle between the normals of the two points of the base
+        Scalar pair_normals_angle;
+        /// Indices of the two points in the base
+        int base_point1, base_point2;
+        /// Output pairs, cleared before the extraction
+        std::vector<std::pair<int, int>>* pairs;
+    };
+
     /// Class for the computation of the 4PCS algorithm.
     /// \param Functor use to determinate the use of Super4pcs or 4pcs algorithm.
+    /// It is built from the sampled Q, the base and the options, and provides:
+    ///  - Initialize(P, Q), building its data structures on the sampled Q once
+    ///    the internal state of the matcher has been set,
+    ///  - InitializeWorker(main), doing the same for the functor of a worker
+    ///    running trials in parallel, reusing the data structures built by
+    ///    the Initialize method of main,
+    ///  - setDeadline(deadline), after which the pair extraction and the
+    ///    congruent set generation stop, returning partial results,
+    ///  - ExtractPairs and FindCongruentQuadrilaterals, generating the
+    ///    congruent sets of a base.
+    /// \see FunctorBase4PCS, FunctorSuper4PCS
     template <template <typename, typename> typename _Functor,
               typename _TransformVisitor,
               typename _PairFilteringFunctor,  /// <\brief Must implements PairFilterConcept
@@ -49,9 +75,16 @@ namespace gr {
         using Coordinates       = typename MatchBaseType::Coordinates;
         using OptionsType       = typename MatchBaseType::OptionsType;
         using Functor           = _Functor<PairFilteringFunctor, OptionsType>;
+        using TrialContext      = typename MatchBaseType::TrialContext;
 
     protected:
         Functor fun_;
+        /// Functors used by the workers running trials in parallel, bound to
+        /// the base of their worker.
+        std::vector<std::unique_ptr<Functor> > worker_funs_;
+
+        inline Functor& functor(const TrialContext& context)
+        { return context.id < 0 ? fun_ : *worker_funs_[context.id]; }
 
     public:
 
@@ -93,7 +126,22 @@ namespace gr {
         /// It could be with a 3 point base or a 4 point base.
         /// \param base use to find the similar points congruent in Q.
         /// \param congruent_set a set of all point congruent found in Q.
-        bool generateCongruents (CongruentBaseType& base,Set& congruent_quads) override;
+        bool generateCongruents (TrialContext& context,
+                                 CongruentBaseType& base,
+                                 Set& congruent_quads) override;
+
+    protected:
+        /// Same as TryQuadrilateral(invariant1, invariant2, id1, id2, id3, id4),
+        /// updating the order of base3D.
+        inline bool TryQuadrilateral(Coordinates& base3D,
+                                     Scalar &invariant1, Scalar &invariant2,
+                                     int &id1, int &id2, int &id3, int &id4) const;
+
+        /// Same as SelectQuadrilateral(invariant1, invariant2, base1, base2,
+        /// base3, base4), using the random generator and base of the context.
+        inline bool SelectQuadrilateral(TrialContext& context,
+                                        Scalar &invariant1, Scalar &invariant2,
+                                        int& base1, int& base2, int& base3, int& base4) const;
 
     private:
         static inline Scalar distSegmentToSegment( const VectorType& p1, const VectorType& p2,
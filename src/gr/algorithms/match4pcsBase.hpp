@@ -35,6 +35,10 @@ namespace gr {
             : MatchBaseType(options,logger)
             , fun_(MatchBaseType::sampled_Q_3D_,MatchBaseType::base_3D_,MatchBaseType::options_)
     {
+        for (const auto& worker : MatchBaseType::trial_workers_)
+            worker_funs_.emplace_back(new Functor(MatchBaseType::sampled_Q_3D_,
+                                                  worker->base3D,
+                                                  MatchBaseType::options_));
     }
 
     template <template <typename, typename> typename _Functor,
@@ -51,6 +55,18 @@ namespace gr {
         typename Point3D::Scalar &invariant1,
         typename Point3D::Scalar &invariant2,
         int &id1, int &id2, int &id3, int &id4) {
+        return TryQuadrilateral(MatchBaseType::base_3D_, invariant1, invariant2, id1, id2, id3, id4);
+    }
+
+    template <template <typename, typename> typename _Functor,
+              typename TransformVisitor,
+              typename PairFilteringFunctor,
+              template < class, class > typename PFO>
+    bool Match4pcsBase<_Functor, TransformVisitor, PairFilteringFunctor, PFO>::TryQuadrilateral(
+        Coordinates& base3D,
+        typename Point3D::Scalar &invariant1,
+        typename Point3D::Scalar &invariant2,
+        int &id1, int &id2, int &id3, int &id4) const {
 
         Scalar min_distance = std::numeric_limits<Scalar>::max();
         int best1, best2, best3, best4;
@@ -67,8 +83,8 @@ namespace gr {
                 // Compute the closest points on both segments, the corresponding
                 // invariants and the distance between the closest points.
                 Scalar segment_distance = distSegmentToSegment(
-                        MatchBaseType::base_3D_[i].pos(), MatchBaseType::base_3D_[j].pos(),
-                        MatchBaseType::base_3D_[k].pos(), MatchBaseType::base_3D_[l].pos(),
+                        base3D[i].pos(), base3D[j].pos(),
+                        base3D[k].pos(), base3D[l].pos(),
                         local_invariant1, local_invariant2);
                 // Retail the smallest distance and the best order so far.
                 if (segment_distance < min_distance) {
@@ -85,11 +101,11 @@ namespace gr {
 
         if(best1 < 0 || best2 < 0 || best3 < 0 || best4 < 0 ) return false;
 
-        Coordinates tmp = MatchBaseType::base_3D_;
-        MatchBaseType::base_3D_[0] = tmp[best1];
-        MatchBaseType::base_3D_[1] = tmp[best2];
-        MatchBaseType::base_3D_[2] = tmp[best3];
-        MatchBaseType::base_3D_[3] = tmp[best4];
+        Coordinates tmp = base3D;
+        base3D[0] = tmp[best1];
+        base3D[1] = tmp[best2];
+        base3D[2] = tmp[best3];
+        base3D[3] = tmp[best4];
 
         CongruentBaseType tmpId = {id1, id2, id3, id4};
         id1 = tmpId[best1];
@@ -108,6 +124,19 @@ namespace gr {
         Scalar &invariant1,
         Scalar &invariant2,
         int& base1, int& base2, int& base3, int& base4)  {
+        TrialContext context = MatchBaseType::mainTrialContext();
+        return SelectQuadrilateral(context, invariant1, invariant2, base1, base2, base3, base4);
+    }
+
+    template <template <typename, typename> typename _Functor,
+              typename TransformVisitor,
+              typename PairFilteringFunctor,
+              template < class, class > typename PFO>
+    bool Match4pcsBase<_Functor, TransformVisitor, PairFilteringFunctor, PFO>::SelectQuadrilateral(
+        TrialContext& context,
+        Scalar &invariant1,
+        Scalar &invariant2,
+        int& base1, int& base2, int& base3, int& base4) const {
 
         const Scalar kBaseTooSmall (0.2);
         int current_trial = 0;
@@ -115,13 +144,13 @@ namespace gr {
         // Try fix number of times.
         while (current_trial < MatchBaseType::kNumberOfDiameterTrials) {
             // Select a triangle if possible. otherwise fail.
-            if (!MatchBaseType::SelectRandomTriangle(base1, base2, base3)){
+            if (!MatchBaseType::SelectRandomTriangle(context.randomGenerator, base1, base2, base3)){
                 return false;
             }
 
-            const auto& b0 = MatchBaseType::base_3D_[0] = MatchBaseType::sampled_P_3D_[base1];
-            const auto& b1 = MatchBaseType::base_3D_[1] = MatchBaseType::sampled_P_3D_[base2];
-            const auto& b2 = MatchBaseType::base_3D_[2] = MatchBaseType::sampled_P_3D_[base3];
+            const auto& b0 = context.base3D[0] = MatchBaseType::sampled_P_3D_[base1];
+            const auto& b1 = context.base3D[1] = MatchBaseType::sampled_P_3D_[base2];
+            const auto& b2 = context.base3D[2] = MatchBaseType::sampled_P_3D_[base3];
 
             // The 4th point will be a one that is close to be planar to the other 3
             // while still not too close to them.
@@ -167,8 +196,8 @@ namespace gr {
                 }
                 // If we have a good one we can quit.
                 if (base4 != -1) {
-                    MatchBaseType::base_3D_[3] = MatchBaseType::sampled_P_3D_[base4];
-                    if(TryQuadrilateral(invariant1, invariant2, base1, base2, base3, base4))
+                    context.base3D[3] = MatchBaseType::sampled_P_3D_[base4];
+                    if(TryQuadrilateral(context.base3D, invariant1, invariant2, base1, base2, base3, base4))
                         return true;
                 }
             }
@@ -188,6 +217,12 @@ namespace gr {
         const std::vector<Point3D>& P,
         const std::vector<Point3D>& Q) {
         fun_.Initialize(P,Q);
+        fun_.setDeadline(MatchBaseType::deadline_);
+        // The workers share the data structures built by fun_
+        for (auto& f : worker_funs_) {
+            f->InitializeWorker(fun_);
+            f->setDeadline(MatchBaseType::deadline_);
+        }
     }
 
 
@@ -196,7 +231,7 @@ namespace gr {
               typename PairFilteringFunctor,
               template < class, class > typename PFO>
     bool Match4pcsBase<_Functor, TransformVisitor, PairFilteringFunctor, PFO>::generateCongruents (
-        CongruentBaseType &base, Set& congruent_quads) {
+        TrialContext& context, CongruentBaseType &base, Set& congruent_quads) {
 //      std::cout << "------------------" << std::endl;
 
       Scalar invariant1, invariant2;
@@ -212,11 +247,11 @@ namespace gr {
       base[2] = 1;
       base[3] = 4;
 
-      MatchBaseType::base_3D_[0] = MatchBaseType::sampled_P_3D_ [base[0]];
-      MatchBaseType::base_3D_[1] = MatchBaseType::sampled_P_3D_ [base[1]];
-      MatchBaseType::base_3D_[2] = MatchBaseType::sampled_P_3D_ [base[2]];
-      MatchBaseType::base_3D_[3] = MatchBaseType::sampled_P_3D_ [base[3]];
-      TryQuadrilateral(invariant1, invariant2, base[0], base[1], base[2], base[3]);
+      context.base3D[0] = MatchBaseType::sampled_P_3D_ [base[0]];
+      context.base3D[1] = MatchBaseType::sampled_P_3D_ [base[1]];
+      context.base3D[2] = MatchBaseType::sampled_P_3D_ [base[2]];
+      context.base3D[3] = MatchBaseType::sampled_P_3D_ [base[3]];
+      TryQuadrilateral(context.base3D, invariant1, invariant2, base[0], base[1], base[2], base[3]);
 
       first_time = false;
   }
@@ -224,30 +259,34 @@ namespace gr {
       return false;
 
 #else
-        if (!SelectQuadrilateral(invariant1, invariant2, base[0], base[1],
+        if (!SelectQuadrilateral(context, invariant1, invariant2, base[0], base[1],
                                  base[2], base[3])) {
 //            std::cout << "Skipping wrong base" << std::endl;
             return false;
         }
 #endif
 //        std::cout << "Found a new base !" << std::endl;
-        const auto& b0 = MatchBaseType::base_3D_[0];
-        const auto& b1 = MatchBaseType::base_3D_[1];
-        const auto& b2 = MatchBaseType::base_3D_[2];
-        const auto& b3 = MatchBaseType::base_3D_[3];
+        const auto& b0 = context.base3D[0];
+        const auto& b1 = context.base3D[1];
+        const auto& b2 = context.base3D[2];
+        const auto& b3 = context.base3D[3];
 
         // Computes distance between pairs.
         const Scalar distance1 = (b0.pos()- b1.pos()).norm();
         const Scalar distance2 = (b2.pos()- b3.pos()).norm();
 
         std::vector<std::pair<int, int>> pairs1, pairs2;
+        Functor& fun = functor(context);
 
         // Compute normal angles.
         const Scalar normal_angle1 = (b0.normal() - b1.normal()).norm();
         const Scalar normal_angle2 = (b2.normal() - b3.normal()).norm();
 
-        fun_.ExtractPairs(distance1, normal_angle1, MatchBaseType::distance_factor * MatchBaseType::options_.delta, 0, 1, &pairs1);
-        fun_.ExtractPairs(distance2, normal_angle2, MatchBaseType::distance_factor * MatchBaseType::options_.delta, 2, 3, &pairs2);
+        // Both pair sets are extracted in a single pass over Q
+        const std::array<PairExtractionQuery, 2> queries {{
+            { distance1, normal_angle1, 0, 1, &pairs1 },
+            { distance2, normal_angle2, 2, 3, &pairs2 } }};
+        fun.ExtractPairs(queries, MatchBaseType::distance_factor * MatchBaseType::options_.delta);
 
 
 //        std::cout << "Pair set 1 has " << pairs1.size() << " elements" << std::endl;
@@ -259,7 +298,7 @@ namespace gr {
             return false;
         }
 
-        if (!fun_.FindCongruentQuadrilaterals(invariant1, invariant2,
+        if (!fun.FindCongruentQuadrilaterals(invariant1, invariant2,
                                          MatchBaseType::distance_factor * MatchBaseType::options_.delta,
                                          MatchBaseType::distance_factor * MatchBaseType::options_.delta,
                                          pairs1,
@@ -45,6 +45,8 @@
 #define _OPENGR_ALGO_MATCH_BASE_
 
 #include <vector>
+#include <atomic>
+#include <chrono>
 
 #ifdef OpenGR_USE_OPENMP
 #include <omp.h>
@@ -53,8 +55,11 @@
 #include "gr/shared.h"
 #include "gr/sampling.h"
 #include "gr/accelerators/kdtree.h"
+#include "gr/accelerators/occupancyGrid.h"
+#include "gr/algorithms/preparedTarget.h"
 #include "gr/utils/logger.h"
 #include "gr/utils/crtp.h"
+#include "gr/utils/deadline.h"
 
 #ifdef TEST_GLOBAL_TIMINGS
 #   include "gr/utils/timer.h"
@@ -89,6 +94,13 @@ public:
         /// Distance threshold used to compute the LCP
         /// \todo Move to DistanceMeasure
         Scalar delta       = Scalar(5.0);
+        /// Use an occupancy grid of P dilated by delta to compute the LCP.
+        /// The kd-tree is then queried only for the points falling in cells
+        /// partially covered by the dilated set.
+        bool use_occupancy_grid = false;
+        /// Select the leaf size of the kd-tree of P by timing queries on the
+        /// sampled P. Worth it when the sample size is large.
+        bool calibrate_kdtree = false;
         /// The number of points in the sample. We sample this number of points
         /// uniformly from P and Q.
         size_t sample_size = 200;
@@ -97,6 +109,12 @@ public:
         /// solution so far.
         /// \warning Max. computation time must be handled in child classes
         int max_time_seconds = 60;
+        /// Maximum computation time, with a millisecond resolution. Overrides
+        /// max_time_seconds when positive.
+        std::chrono::milliseconds max_time = std::chrono::milliseconds::zero();
+        /// External cancellation token, not owned. The computation is stopped
+        /// as soon as it is set to true, producing the best solution so far.
+        const std::atomic<bool>* cancellation_token = nullptr;
         /// use a constant default seed by default
         unsigned int randomSeed = std::mt19937::default_seed;
 
@@ -128,6 +146,11 @@ public:
         return sampled_Q_3D_;
     }
 
+    /// Parameters used to build the kd-tree of the sampled P
+    typename KdTree<Scalar>::BuildParameters getKdTreeParameters() const {
+        return kd_tree_.buildParameters();
+    }
+
 
 #ifdef PARSED_BY_DOXYGEN
     /// Computes an approximation of the best LCP (directional) from Q to P
@@ -171,6 +194,11 @@ protected:
     VectorType qcentroid2_;
     /// KdTree used to compute the LCP
     KdTree<Scalar> kd_tree_;
+    /// Occupancy grid of P dilated by delta, used to compute the LCP.
+    /// Empty if disabled in the options.
+    OccupancyGrid<Scalar> occupancy_grid_;
+    /// Deadline of the current computation, started by init()
+    Utils::Deadline deadline_;
     std::mt19937 randomGenerator_;
     const Utils::Logger &logger_;
 
@@ -184,12 +212,6 @@ protected :
     inline void Log(Args...args) const { logger_.Log<level>(args...); }
 
 
-    /// Computes the mean distance between points in Q and their nearest neighbor.
-    /// We need this for normalization of the user delta (See the paper) to the
-    /// "scale" of the set.
-    Scalar MeanDistance() const;
-
-
     /// Selects a random triangle in the set P (then we add another point to keep the
     /// base as planar as possible). We apply a simple heuristic that works in most
     /// practical cases. The idea is to accept maximum distance, computed by the
@@ -199,6 +221,11 @@ protected :
     /// probability of having all points in the inliers small so we try to trade-off.
     bool SelectRandomTriangle(int& base1, int& base2, int& base3);
 
+    /// Same as SelectRandomTriangle(base1, base2, base3), using the given random
+    /// generator
+    bool SelectRandomTriangle(std::mt19937& generator,
+                              int& base1, int& base2, int& base3) const;
+
     /// Computes the best rigid transformation between three corresponding pairs.
     /// The transformation is characterized by rotation matrix, translation vector
     /// and a center about which we rotate. The set of pairs is potentially being
@@ -221,9 +248,9 @@ protected :
 
     /// Initializes the data structures and needed values before the match
     /// computation.
-    /// @param [in] point_P First input set.
-    /// @param [in] point_Q Second input set.
-    /// expected to be in the inliers.
+    /// @param [in] P Sampled first input set, centered on centroid_P_ (same as
+    /// sampled_P_3D_), whether P has been prepared or not.
+    /// @param [in] Q Second input set.
     /// This method is called once the internal state of the Base class as been
     /// set.
     virtual void Initialize(const std::vector<Point3D>& /*P*/,
@@ -233,9 +260,33 @@ protected :
     void init(const std::vector<Point3D>& P,
               const std::vector<Point3D>& Q,
               const Sampler& sampler);
+
+    /// Same as init(P, Q, sampler), reusing the preprocessing of P.
+    template <typename Sampler>
+    void init(const PreparedTarget& P,
+              const std::vector<Point3D>& Q,
+              const Sampler& sampler);
 private:
 
-    void initKdTree();
+    void startDeadline();
+
+    /// Copies the sampled P and its acceleration structures
+    void initTarget(const PreparedTarget& P);
+
+    /// Same as initTarget(const PreparedTarget&), moving the sampled P and
+    /// its acceleration structures out of the temporary target
+    void initTarget(PreparedTarget&& P);
+
+    /// Implementation of initTarget, Target being PreparedTarget or
+    /// const PreparedTarget&
+    template <typename Target>
+    void assignTarget(Target&& P);
+
+    /// Samples Q and initializes the state depending on both sets, once the
+    /// target has been set by initTarget
+    template <typename Sampler>
+    void initSource(const std::vector<Point3D>& Q,
+                    const Sampler& sampler);
 
 }; /// class MatchBase
 } /// namespace Super4PCS
@@ -3,6 +3,7 @@
 //
 
 #include <vector>
+#include <utility>
 #include <atomic>
 #include <chrono>
 
@@ -42,39 +43,20 @@ MATCH_BASE_TYPE::~MatchBase(){}
 
 
 template <typename TransformVisitor, template < class, class > typename ... OptExts>
-typename MATCH_BASE_TYPE::Scalar
-MATCH_BASE_TYPE::MeanDistance() const {
-    const Scalar kDiameterFraction = 0.2;
-    using RangeQuery = gr::KdTree<Scalar>::RangeQuery<>;
-
-    int number_of_samples = 0;
-    Scalar distance = 0.0;
-
-    for (size_t i = 0; i < sampled_P_3D_.size(); ++i) {
-
-        RangeQuery query;
-        query.sqdist = P_diameter_ * kDiameterFraction;
-        query.queryPoint = sampled_P_3D_[i].pos().template cast<Scalar>();
-
-        auto resId = kd_tree_.doQueryRestrictedClosestIndex(query , i).first;
-
-        if (resId != gr::KdTree<Scalar>::invalidIndex()) {
-            distance += (sampled_P_3D_[i].pos() - sampled_P_3D_[resId].pos()).norm();
-            number_of_samples++;
-        }
-    }
-
-    return distance / number_of_samples;
+bool
+MATCH_BASE_TYPE::SelectRandomTriangle(int &base1, int &base2, int &base3) {
+    return SelectRandomTriangle(randomGenerator_, base1, base2, base3);
 }
 
 template <typename TransformVisitor, template < class, class > typename ... OptExts>
 bool
-MATCH_BASE_TYPE::SelectRandomTriangle(int &base1, int &base2, int &base3) {
+MATCH_BASE_TYPE::SelectRandomTriangle(std::mt19937& generator,
+                                      int &base1, int &base2, int &base3) const {
     int number_of_points = sampled_P_3D_.size();
     base1 = base2 = base3 = -1;
 
     // Pick the first point at random.
-    int first_point = randomGenerator_() % number_of_points;
+    int first_point = generator() % number_of_points;
 
     const Scalar sq_max_base_diameter_ = max_base_diameter_*max_base_diameter_;
 
@@ -82,8 +64,8 @@ MATCH_BASE_TYPE::SelectRandomTriangle(int &base1, int &base2, int &base3) {
     Scalar best_wide = 0.0;
     for (int i = 0; i < kNumberOfDiameterTrials; ++i) {
         // Pick and compute
-        const int second_point = randomGenerator_() % number_of_points;
-        const int third_point = randomGenerator_() % number_of_points;
+        const int second_point = generator() % number_of_points;
+        const int third_point = generator() % number_of_points;
         const VectorType u =
                 sampled_P_3D_[second_point].pos() -
                 sampled_P_3D_[first_point].pos();
@@ -104,21 +86,6 @@ MATCH_BASE_TYPE::SelectRandomTriangle(int &base1, int &base2, int &base3) {
     return base1 != -1 && base2 != -1 && base3 != -1;
 }
 
-template <typename TransformVisitor, template < class, class > typename ... OptExts>
-void
-MATCH_BASE_TYPE::initKdTree(){
-    size_t number_of_points = sampled_P_3D_.size();
-
-    // Build the kdtree.
-    kd_tree_ = gr::KdTree<Scalar>(number_of_points);
-
-    for (size_t i = 0; i < number_of_points; ++i) {
-        kd_tree_.add(sampled_P_3D_[i].pos());
-    }
-    kd_tree_.finalize();
-}
-
-
 template <typename TransformVisitor, template < class, class > typename ... OptExts>
 template <typename Coordinates>
 bool
@@ -257,29 +224,79 @@ MATCH_BASE_TYPE::ComputeRigidTransformation(const Coordinates& ref,
 }
 
 
+template <typename TransformVisitor, template < class, class > typename ... OptExts>
+void MATCH_BASE_TYPE::startDeadline(){
+    if (options_.max_time.count() > 0)
+        deadline_ = Utils::Deadline(options_.max_time, options_.cancellation_token);
+    else
+        deadline_ = Utils::Deadline(std::chrono::seconds(options_.max_time_seconds),
+                                    options_.cancellation_token);
+}
+
+template <typename TransformVisitor, template < class, class > typename ... OptExts>
+void MATCH_BASE_TYPE::initTarget(const PreparedTarget& P){
+    assignTarget(P);
+}
+
+template <typename TransformVisitor, template < class, class > typename ... OptExts>
+void MATCH_BASE_TYPE::initTarget(PreparedTarget&& P){
+    assignTarget(std::move(P));
+}
+
+template <typename TransformVisitor, template < class, class > typename ... OptExts>
+template <typename Target>
+void MATCH_BASE_TYPE::assignTarget(Target&& P){
+    // Each member is read once, so the target can be moved member-wise
+    sampled_P_3D_ = std::forward<Target>(P).points();
+    centroid_P_   = P.centroid();
+    kd_tree_      = std::forward<Target>(P).kdTree();
+
+    // The grid of the target is reused if it has been built with our delta
+    if (! options_.use_occupancy_grid)
+        occupancy_grid_.clear();
+    else if (! P.occupancyGrid().empty() && P.delta() == options_.delta)
+        occupancy_grid_ = std::forward<Target>(P).occupancyGrid();
+    else
+        occupancy_grid_.build(sampled_P_3D_, options_.delta);
+
+    P_mean_distance_ = P.meanDistance();
+}
+
 template <typename TransformVisitor, template < class, class > typename ... OptExts>
 template <typename Sampler>
 void MATCH_BASE_TYPE::init(const std::vector<Point3D>& P,
                      const std::vector<Point3D>& Q,
                      const Sampler& sampler){
-
-    centroid_P_ = VectorType::Zero();
-    centroid_Q_ = VectorType::Zero();
-
-    sampled_P_3D_.clear();
-    sampled_Q_3D_.clear();
+    startDeadline();
 
     // prepare P
-    if (P.size() > options_.sample_size){
-        sampler(P, options_, sampled_P_3D_);
-    }
-    else
-    {
+    if (P.size() <= options_.sample_size)
         Log<LogLevel::ErrorReport>( "(P) More samples requested than available: use whole cloud" );
-        sampled_P_3D_ = P;
-    }
+    PreparedTarget target (P, sampler, options_);
+    if (target.kdTreeCalibrated())
+        Log<LogLevel::Verbose>( "Calibrated KdTree leaf size: ",
+                                target.kdTreeParameters().nofPointsPerCell );
+    initTarget(std::move(target));
 
+    initSource(Q, sampler);
+}
 
+template <typename TransformVisitor, template < class, class > typename ... OptExts>
+template <typename Sampler>
+void MATCH_BASE_TYPE::init(const PreparedTarget& P,
+                     const std::vector<Point3D>& Q,
+                     const Sampler& sampler){
+    startDeadline();
+    initTarget(P);
+    initSource(Q, sampler);
+}
+
+template <typename TransformVisitor, template < class, class > typename ... OptExts>
+template <typename Sampler>
+void MATCH_BASE_TYPE::initSource(const std::vector<Point3D>& Q,
+                           const Sampler& sampler){
+    centroid_Q_ = VectorType::Zero();
+    sampled_Q_3D_.clear();
 
     // prepare Q
     if (Q.size() > options_.sample_size){
@@ -299,18 +316,11 @@ void MATCH_BASE_TYPE::init(const std::vector<Point3D>& P,
     }
 
 
-    // center points around centroids
-    auto centerPoints = [](std::vector<Point3D>&container,
-            VectorType& centroid){
-        for(const auto& p : container) centroid += p.pos();
-        centroid /= Scalar(container.size());
-        for(auto& p : container) p.pos() -= centroid;
-    };
-    centerPoints(sampled_P_3D_, centroid_P_);
-    centerPoints(sampled_Q_3D_, centroid_Q_);
-
+    // center points around centroid
+    for(const auto& p : sampled_Q_3D_) centroid_Q_ += p.pos();
+    centroid_Q_ /= Scalar(sampled_Q_3D_.size());
+    for(auto& p : sampled_Q_3D_) p.pos() -= centroid_Q_;
 
-    initKdTree();
     // Compute the diameter of P approximately (randomly). This is far from being
     // Guaranteed close to the diameter but gives good results for most common
     // objects if they are densely sampled.
@@ -325,10 +335,6 @@ void MATCH_BASE_TYPE::init(const std::vector<Point3D>& P,
         }
     }
 
-    // Mean distance and a bit more... We increase the estimation to allow for
-    // noise, wrong estimation and non-uniform sampling.
-    P_mean_distance_ = MeanDistance();
-
     // Normalize the delta (See the paper) and the maximum base distance.
     // delta = P_mean_distance_ * delta;
     max_base_diameter_ = P_diameter_;  // * estimated_overlap_;
@@ -336,7 +342,7 @@ void MATCH_BASE_TYPE::init(const std::vector<Point3D>& P,
     transform_ = Eigen::Matrix<Scalar, 4, 4>::Identity();
 
     // call Virtual handler
-    Initialize(P,Q);
+    Initialize(sampled_P_3D_, Q);
 }
 
 }
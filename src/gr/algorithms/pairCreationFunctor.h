@@ -4,10 +4,13 @@
 #include <iostream>
 #include <vector>
 #include "gr/shared.h"
+#include "gr/utils/deadline.h"
 
 #include "gr/accelerators/pairExtraction/bruteForceFunctor.h"
 #include "gr/accelerators/pairExtraction/intersectionFunctor.h"
 #include "gr/accelerators/pairExtraction/intersectionPrimitive.h"
+#include "gr/accelerators/pairExtraction/intersectionTree.h"
+#include "gr/accelerators/pairExtraction/pairDistanceIndex.h"
 #include "gr/algorithms/match4pcsBase.h"
 
 namespace gr {
@@ -24,14 +27,11 @@ public:
 
   // Shared data
   OptionType options_;
-  double pair_distance;
-  double pair_normals_angle;
   double pair_distance_epsilon;
   const std::vector<Point3D>& Q_;
 
-  PairsVector* pairs;
-
-  std::vector<unsigned int> ids;
+  /// The pairs are not collected anymore once the deadline is passed
+  Utils::Deadline deadline;
 
 
   // Internal data
@@ -39,16 +39,36 @@ public:
   typedef Accelerators::PairExtraction::HyperSphere
   < typename PairCreationFunctor::Point, 3, Scalar> Primitive;
 
+  using Tree = Accelerators::PairExtraction::NdTree
+  < typename PairCreationFunctor::Point, 3, Scalar>;
+  using PairIndex = Accelerators::PairExtraction::PairDistanceIndex
+  < typename PairCreationFunctor::Point, 3, Scalar>;
+
   std::vector< /*Eigen::Map<*/typename PairCreationFunctor::Point/*>*/ > points;
   std::vector< Primitive > primitives;
 
+  /// Subdivision of points, built once by synch3DContent
+  inline const Tree& tree() const { return *tree_; }
+  /// Pairs of points sorted by distance, built by synch3DContent when
+  /// options_.use_pair_index is set
+  inline const PairIndex& pairIndex() const { return *pairIndex_; }
+
 private:
-  VectorType segment1;
+  Tree ownTree_;
+  PairIndex ownPairIndex_;
+  /// Structures used by the queries: the own ones, or the ones of the functor
+  /// given to synch3DContent(const PairCreationFunctor&)
+  const Tree* tree_;
+  const PairIndex* pairIndex_;
+
   BaseCoordinates base_3D_;
-  int base_point1_, base_point2_;
+  /// Pairs extracted by process(), see setQueries
+  const PairExtractionQuery* queries_;
+  size_t nbQueries_;
 
   typename PairCreationFunctor::Point _gcenter;
   Scalar _ratio;
+  bool _interrupted;
   static const typename PairCreationFunctor::Point half;
 
 public:
@@ -56,9 +76,14 @@ public:
     const OptionType& options,
     const std::vector<Point3D>& Q)
     :options_(options), Q_(Q),
-     pairs(NULL), _ratio(1.f)
+     tree_(&ownTree_), pairIndex_(&ownPairIndex_),
+     queries_(nullptr), nbQueries_(0), _ratio(1.f), _interrupted(false)
     { }
 
+  // The structures are either owned or shared, and are not copied
+  PairCreationFunctor(const PairCreationFunctor&) = delete;
+  PairCreationFunctor& operator=(const PairCreationFunctor&) = delete;
+
 private:
   inline Point worldToUnit(
     const Eigen::MatrixBase<typename PairCreationFunctor::Point> &p) const {
@@ -115,8 +140,35 @@ public:
       points[i] = worldToUnit(points[i]);
 
       primitives.emplace_back(points[i], Scalar(1.));
-      ids.push_back(i);
     }
+
+    ownTree_.build(points);
+    if (options_.use_pair_index)
+      ownPairIndex_.build(points);
+    else
+      ownPairIndex_.clear();
+    tree_      = &ownTree_;
+    pairIndex_ = &ownPairIndex_;
+  }
+
+  /// Same as synch3DContent(), reusing the subdivision and the pair index
+  /// built by other, which must be synchronized with the same set Q and stay
+  /// alive while this functor is used. Only the points and the primitives
+  /// are copied, as the radius of the primitives is set by each query.
+  inline void synch3DContent(const PairCreationFunctor& other){
+    points   = other.points;
+    _gcenter = other._gcenter;
+    _ratio   = other._ratio;
+
+    primitives.clear();
+    primitives.reserve(points.size());
+    for (const auto& p : points)
+      primitives.emplace_back(p, Scalar(1.));
+
+    ownTree_.clear();
+    ownPairIndex_.clear();
+    tree_      = other.tree_;
+    pairIndex_ = other.pairIndex_;
   }
 
   inline void setRadius(Scalar radius) {
@@ -130,23 +182,80 @@ public:
     return eps/_ratio;
   }
 
-  inline void setBase( int base_point1, int base_point2,
-                       const BaseCoordinates& base_3D){
-    base_3D_     = base_3D;
-    base_point1_ = base_point1;
-    base_point2_ = base_point2;
+  inline Scalar getNormalizedRadius(Scalar radius) const {
+    return radius/_ratio;
+  }
 
-    segment1 = (base_3D_[base_point2_].pos() -
-                base_3D_[base_point1_].pos()).normalized();
+  /// Sets the pairs of the base for which process() collects pairs
+  inline void setQueries( const PairExtractionQuery* queries, size_t nbQueries,
+                          const BaseCoordinates& base_3D){
+    base_3D_   = base_3D;
+    queries_   = queries;
+    nbQueries_ = nbQueries;
   }
 
+  inline size_t nbQueries() const { return nbQueries_; }
 
-  inline void beginPrimitiveCollect(int /*primId*/){ }
+
+  inline void beginPrimitiveCollect(int /*primId*/){
+    _interrupted = deadline.expired();
+  }
   inline void endPrimitiveCollect(int /*primId*/){ }
 
 
+  /// Collects the pairs of the current queries by scanning pairIndex,
+  /// instead of traversing the subdivision of the points.
+  inline void processIndexedPairs(){
+    const Scalar eps = getNormalizedEpsilon(Scalar(pair_distance_epsilon));
+    _interrupted = false;
+    for (size_t k = 0; k != nbQueries_ && !_interrupted; ++k) {
+      const Scalar radius = getNormalizedRadius(queries_[k].pair_distance);
+      const auto range = pairIndex_->range(radius - eps, radius + eps);
+      size_t count = 0;
+      for (auto it = range.first; it != range.second; ++it, ++count) {
+        if ((count & 1023) == 0 && (_interrupted = deadline.expired())) break;
+        collectPair(it->first, it->second, k, *queries_[k].pairs);
+      }
+    }
+  }
+
+  /// Collects the pair (i, j) for the first query
   inline void process(int i, int j){
-    if (i>j){
+    process(i, j, 0);
+  }
+
+  /// Collects the pair (i, j) for the k-th query
+  inline void process(int i, int j, int k){
+    if (i>j && !_interrupted)
+      collectPair(i, j, k, *queries_[k].pairs);
+  }
+
+  /// Collects the pairs of a part of the extraction in its own buffers, one
+  /// per query, so that several parts can be processed concurrently.
+  struct PairCollector{
+    const PairCreationFunctor* functor;
+    std::vector<PairsVector> pairs;
+    bool interrupted;
+
+    inline void beginPrimitiveCollect(int /*primId*/){
+      interrupted = functor->deadline.expired();
+    }
+    inline void endPrimitiveCollect(int /*primId*/){ }
+    inline void process(int i, int j, int k){
+      if (i>j && !interrupted)
+        functor->collectPair(i, j, k, pairs[k]);
+    }
+  };
+
+  /// Creates an empty collector for the current queries
+  inline PairCollector collector() const {
+    return PairCollector {this, std::vector<PairsVector>(nbQueries_), false};
+  }
+
+private:
+  /// Appends the pair (i, j) to pairs if it matches the k-th query
+  inline void collectPair(int i, int j, int k, PairsVector& pairs) const {
+      const PairExtractionQuery& query = queries_[k];
       const Point3D& p = Q_[j];
       const Point3D& q = Q_[i];
 
@@ -157,15 +266,14 @@ public:
       // defined by segment matching alone..
       const Scalar distance = (q.pos() - p.pos()).norm();
 #ifndef MULTISCALE
-      if (std::abs(distance - pair_distance) > pair_distance_epsilon) return;
+      if (std::abs(distance - double(query.pair_distance)) > pair_distance_epsilon) return;
 #endif
         FilterFunctor fun;
-        std::pair<bool,bool> res = fun(p,q, pair_normals_angle, base_3D_[base_point1_],base_3D_[base_point2_], options_);
+        std::pair<bool,bool> res = fun(p,q, query.pair_normals_angle, base_3D_[query.base_point1],base_3D_[query.base_point2], options_);
         if (res.first)
-            pairs->emplace_back(i, j);
+            pairs.emplace_back(i, j);
         if (res.second)
-            pairs->emplace_back(j, i);
-    }
+            pairs.emplace_back(j, i);
   }
 };
 
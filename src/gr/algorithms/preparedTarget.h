@@ -0,0 +1,185 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _OPENGR_ALGO_PREPARED_TARGET_H
+#define _OPENGR_ALGO_PREPARED_TARGET_H
+
+#include <vector>
+#include <utility>
+#include <Eigen/Geometry>
+
+#include "gr/shared.h"
+#include "gr/accelerators/kdtree.h"
+#include "gr/accelerators/occupancyGrid.h"
+
+namespace gr {
+
+/*!
+  \brief Preprocessed target set P, reused by several registrations.
+
+  Stores the sampled P centered on its centroid, the kd-tree and optional
+  occupancy grid used to compute the LCP, and statistics of the set. Only Q
+  is then processed by ComputeTransformation.
+
+  The target is not modified once built, so it can be used concurrently by
+  several matchers. The matchers must use the same sample_size and delta
+  options as the target to produce the same results as when given the raw
+  set P.
+  */
+class PreparedTarget {
+public:
+    using Scalar     = typename Point3D::Scalar;
+    using VectorType = typename Point3D::VectorType;
+
+    /// Samples and indexes P. The occupancy grid is built if enabled in the
+    /// options.
+    template <typename Sampler, typename Options>
+    inline PreparedTarget(const std::vector<Point3D>& P,
+                          const Sampler& sampler,
+                          const Options& options);
+
+    inline bool empty() const { return sampled_points_.empty(); }
+
+    /// Sampled P, centered on centroid()
+    inline const std::vector<Point3D>& points() const & { return sampled_points_; }
+    inline std::vector<Point3D>&& points() && { return std::move(sampled_points_); }
+    /// Centroid of the sampled P
+    inline const VectorType& centroid() const { return centroid_; }
+    /// KdTree of points(), its leaf size being selected by
+    /// KdTree::calibrate when requested by the options
+    inline const KdTree<Scalar>& kdTree() const & { return kd_tree_; }
+    inline KdTree<Scalar>&& kdTree() && { return std::move(kd_tree_); }
+    /// Parameters used to build kdTree()
+    inline const KdTree<Scalar>::BuildParameters& kdTreeParameters() const
+    { return kd_tree_parameters_; }
+    /// True if kdTreeParameters() have been selected by KdTree::calibrate
+    inline bool kdTreeCalibrated() const { return kd_tree_calibrated_; }
+    /// Occupancy grid of points() dilated by delta(), empty if not requested
+    inline const OccupancyGrid<Scalar>& occupancyGrid() const & { return occupancy_grid_; }
+    inline OccupancyGrid<Scalar>&& occupancyGrid() && { return std::move(occupancy_grid_); }
+    /// Distance used for the sampling and the occupancy grid
+    inline Scalar delta() const { return delta_; }
+    /// Diagonal of the bounding box of points()
+    inline Scalar diameter() const { return diameter_; }
+    /// Mean distance between the points and their nearest neighbor, computed
+    /// with a (1+0.1)-approximate nearest neighbor query
+    inline Scalar meanDistance() const { return mean_distance_; }
+
+private:
+    /// Computes the mean distance between points and their nearest neighbor.
+    inline Scalar computeMeanDistance() const;
+
+    std::vector<Point3D> sampled_points_;
+    VectorType centroid_;
+    KdTree<Scalar> kd_tree_;
+    KdTree<Scalar>::BuildParameters kd_tree_parameters_;
+    bool kd_tree_calibrated_;
+    OccupancyGrid<Scalar> occupancy_grid_;
+    Scalar delta_;
+    Scalar diameter_;
+    Scalar mean_distance_;
+
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+
+template <typename Sampler, typename Options>
+PreparedTarget::PreparedTarget(const std::vector<Point3D>& P,
+                               const Sampler& sampler,
+                               const Options& options)
+    : centroid_(VectorType::Zero())
+    , kd_tree_calibrated_(false)
+    , delta_(options.delta)
+    , diameter_(0)
+    , mean_distance_(0)
+{
+    if (P.size() > options.sample_size)
+        sampler(P, options, sampled_points_);
+    else
+        sampled_points_ = P;
+
+    if (sampled_points_.empty()) return;
+
+    // center points around the centroid
+    for(const auto& p : sampled_points_) centroid_ += p.pos();
+    centroid_ /= Scalar(sampled_points_.size());
+    for(auto& p : sampled_points_) p.pos() -= centroid_;
+
+    if (options.calibrate_kdtree) {
+        typename KdTree<Scalar>::PointList positions;
+        positions.reserve(sampled_points_.size());
+        for (const auto& p : sampled_points_)
+            positions.push_back(p.pos());
+        kd_tree_parameters_ = KdTree<Scalar>::calibrate(positions, options.delta * options.delta);
+        kd_tree_calibrated_ = true;
+    }
+
+    kd_tree_ = KdTree<Scalar>(sampled_points_.size(), kd_tree_parameters_);
+    for (const auto& p : sampled_points_)
+        kd_tree_.add(p.pos());
+    kd_tree_.finalize();
+
+    if (options.use_occupancy_grid)
+        occupancy_grid_.build(sampled_points_, options.delta);
+
+    Eigen::AlignedBox<Scalar, 3> bbox;
+    for (const auto& p : sampled_points_)
+        bbox.extend(p.pos());
+    diameter_ = bbox.diagonal().norm();
+
+    mean_distance_ = computeMeanDistance();
+}
+
+typename PreparedTarget::Scalar
+PreparedTarget::computeMeanDistance() const {
+    const Scalar kDiameterFraction = 0.2;
+    // the statistic does not need the exact nearest neighbors
+    const Scalar kApproximation = 0.1;
+    using KdTreeType = gr::KdTree<Scalar>;
+
+    // query the nearest neighbor of all the points at once, the points being
+    // excluded from their own queries
+    const unsigned int n = sampled_points_.size();
+    typename KdTreeType::PointList positions (n);
+    std::vector<typename KdTreeType::Index> currentIds (n);
+    for (unsigned int i = 0; i < n; ++i) {
+        positions[i]  = sampled_points_[i].pos().template cast<Scalar>();
+        currentIds[i] = i;
+    }
+
+    std::vector<typename KdTreeType::Index> neighbors (n);
+    std::vector<Scalar> sqdists (n);
+    kd_tree_.doQueryKNearestIndicesBatch<1>(positions.data(), n,
+                                            diameter_ * kDiameterFraction,
+                                            neighbors.data(), sqdists.data(),
+                                            currentIds.data(), false,
+                                            kApproximation);
+
+    int number_of_samples = 0;
+    Scalar distance = 0.0;
+
+    for (size_t i = 0; i < n; ++i) {
+        auto resId = neighbors[i];
+
+        if (resId != KdTreeType::invalidIndex()) {
+            distance += (sampled_points_[i].pos() - sampled_points_[resId].pos()).norm();
+            number_of_samples++;
+        }
+    }
+
+    return number_of_samples == 0 ? Scalar(0) : distance / number_of_samples;
+}
+
+} // namespace gr
+
+#endif // _OPENGR_ALGO_PREPARED_TARGET_H
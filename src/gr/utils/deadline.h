@@ -0,0 +1,75 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _OPENGR_UTILS_DEADLINE_H_
+#define _OPENGR_UTILS_DEADLINE_H_
+
+#include <atomic>
+#include <chrono>
+
+namespace gr{
+namespace Utils{
+
+/*!
+  \brief Time budget of a computation, combined with an optional external
+  cancellation token.
+
+  A default constructed deadline never expires. Deadlines are cheap to copy,
+  and copies share the cancellation token, so they can be given to the
+  functors doing the heavy lifting.
+  */
+class Deadline {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    inline Deadline()
+        : start_(clock::now()), end_(clock::time_point::max()), token_(nullptr) {}
+
+    /// Starts a deadline expiring after budget, or when token is set to true.
+    /// A null or negative budget means no time limit.
+    template <typename Rep, typename Period>
+    inline Deadline(std::chrono::duration<Rep, Period> budget,
+                    const std::atomic<bool>* token = nullptr)
+        : start_(clock::now()), end_(clock::time_point::max()), token_(token) {
+        if (budget > std::chrono::duration<Rep, Period>::zero())
+            end_ = start_ + std::chrono::duration_cast<clock::duration>(budget);
+    }
+
+    /// Returns true if the cancellation has been requested
+    inline bool cancelled() const {
+        return token_ != nullptr && token_->load(std::memory_order_relaxed);
+    }
+
+    /// Returns true if the time budget is exhausted or the cancellation has
+    /// been requested
+    inline bool expired() const {
+        return cancelled() ||
+               (end_ != clock::time_point::max() && clock::now() >= end_);
+    }
+
+    /// Fraction of the time budget already elapsed, 0 without time limit
+    inline double elapsedFraction() const {
+        if (end_ == clock::time_point::max()) return 0.;
+        return std::chrono::duration<double>(clock::now() - start_).count() /
+               std::chrono::duration<double>(end_ - start_).count();
+    }
+
+private:
+    clock::time_point start_;
+    clock::time_point end_;
+    const std::atomic<bool>* token_;
+};
+
+} // namespace Utils
+} // namespace gr
+
+#endif // _OPENGR_UTILS_DEADLINE_H_
@@ -0,0 +1,106 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _OPENGR_UTILS_MAPPED_FILE_H_
+#define _OPENGR_UTILS_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define OPENGR_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+namespace gr{
+namespace Utils{
+
+/*!
+  \brief Read-only view of a whole file.
+
+  The file is mapped in memory when the platform supports it, so that its
+  pages are loaded on demand and shared between the processes mapping the
+  same file. Otherwise, the file is read in a buffer.
+  */
+class MappedFile {
+public:
+    inline MappedFile() : data_(nullptr), size_(0) {}
+    inline explicit MappedFile(const std::string& filename)
+        : data_(nullptr), size_(0) { open(filename); }
+    inline ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /// Maps filename, returns false if the file cannot be read
+    inline bool open(const std::string& filename) {
+        close();
+#ifdef OPENGR_HAS_MMAP
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = data;
+                size_ = st.st_size;
+            }
+        }
+        ::close(fd);
+#else
+        std::ifstream in (filename, std::ios_base::in | std::ios_base::binary);
+        if (! in) return false;
+        in.seekg(0, std::ios_base::end);
+        buffer_.resize(std::size_t(in.tellg()));
+        in.seekg(0, std::ios_base::beg);
+        if (buffer_.empty() || ! in.read(buffer_.data(), buffer_.size())) {
+            buffer_.clear();
+            return false;
+        }
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+        return data_ != nullptr;
+    }
+
+    inline void close() {
+#ifdef OPENGR_HAS_MMAP
+        if (data_ != nullptr) ::munmap(data_, size_);
+#else
+        buffer_.clear();
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    inline bool isOpen() const { return data_ != nullptr; }
+    inline const void* data() const { return data_; }
+    inline std::size_t size() const { return size_; }
+
+private:
+    void* data_;
+    std::size_t size_;
+#ifndef OPENGR_HAS_MMAP
+    std::vector<char> buffer_;
+#endif
+};
+
+} // namespace Utils
+} // namespace gr
+
+#endif // _OPENGR_UTILS_MAPPED_FILE_H_
@@ -48,6 +48,7 @@
 #define _OPENGR_UTILS_TIMER_H_
 
 #include <chrono>  //timers
+#include <ostream>
 #include "gr/utils/disablewarnings.h"
 
 namespace gr{
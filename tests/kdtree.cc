@@ -0,0 +1,715 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// This test checks the queries of the KdTree on random data, and reports the
+// query timings of the different layouts of the tree.
+
+#include "gr/accelerators/kdtree.h"
+#include "gr/accelerators/dynamicKdTree.h"
+#include "gr/utils/mappedFile.h"
+#include "gr/utils/timer.h"
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "testing.h"
+
+#define TRACE
+
+using namespace gr;
+
+typedef KdTree<float> KdTreeType;
+typedef KdTreeType::VectorType VectorType;
+
+/*!
+ * \brief Generates points on a sphere, and queries located near the sphere
+ */
+void generateData(unsigned int nbPoints, unsigned int nbQueries,
+                  std::vector<VectorType>& points,
+                  std::vector<VectorType>& queries) {
+    points.clear();
+    queries.clear();
+    for(unsigned int i = 0; i != nbPoints; i++)
+        points.push_back(VectorType::Random().normalized());
+    for(unsigned int i = 0; i != nbQueries; i++)
+        queries.push_back(VectorType::Random().normalized() + 0.01f * VectorType::Random());
+}
+
+inline KdTreeType buildTree(const std::vector<VectorType>& points) {
+    KdTreeType tree (points.size());
+    for (const auto& p : points)
+        tree.add(p);
+    tree.finalize();
+    return tree;
+}
+
+/*!
+ * \brief Checks that the points stored as structure of arrays match the input
+ * points, including when points are added after finalize()
+ */
+void testPointStorage(unsigned int nbPoints, unsigned int nbQueries) {
+    std::vector<VectorType> points, queries;
+    generateData(nbPoints, nbQueries, points, queries);
+
+    KdTreeType tree (points.size());
+    for (unsigned int i = 0; i != nbPoints/2; ++i)
+        tree.add(points[i]);
+    tree.finalize();
+    for (unsigned int i = nbPoints/2; i != nbPoints; ++i)
+        tree.add(points[i]);
+    tree.finalize();
+
+    VERIFY( tree.size() == nbPoints );
+    for (unsigned int i = 0; i != nbPoints; ++i)
+        VERIFY( tree._getPoint(i) == points[tree._getIndices()[i]] );
+
+    const float sqdist = 0.001f;
+    for (const auto& q : queries) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = q;
+        query.sqdist = sqdist;
+        std::vector<VectorType> result;
+        tree.doQueryDist(query, result);
+
+        std::vector<VectorType> expected;
+        for (const auto& p : points)
+            if ((p - q).squaredNorm() < sqdist)
+                expected.push_back(p);
+        VERIFY( result.size() == expected.size() );
+        for (const auto& p : result)
+            VERIFY( std::find(expected.begin(), expected.end(), p) != expected.end() );
+    }
+}
+
+/*!
+ * \brief Checks that two trees have the same nodes, points and indices
+ */
+template <typename TreeType>
+void verifySameTree(const TreeType& a, const TreeType& b) {
+    VERIFY( a.size() == b.size() );
+    VERIFY( a._getIndices() == b._getIndices() );
+    for (typename TreeType::SizeType i = 0; i != a.size(); ++i)
+        VERIFY( a._getPoint(i) == b._getPoint(i) );
+
+    const auto& nodesA = a._getNodes();
+    const auto& nodesB = b._getNodes();
+    VERIFY( nodesA.size() == nodesB.size() );
+    for (std::size_t i = 0; i != nodesA.size(); ++i) {
+        VERIFY( nodesA[i].leaf == nodesB[i].leaf );
+        if (nodesA[i].leaf) {
+            VERIFY( nodesA[i].start == nodesB[i].start );
+            VERIFY( nodesA[i].size  == nodesB[i].size );
+        } else {
+            VERIFY( nodesA[i].dim          == nodesB[i].dim );
+            VERIFY( nodesA[i].splitValue   == nodesB[i].splitValue );
+            VERIFY( nodesA[i].firstChildId == nodesB[i].firstChildId );
+        }
+    }
+}
+
+/*!
+ * \brief Checks that the trees built with one and several threads are the same
+ */
+void testParallelBuild(unsigned int nbPoints, int nbThreads) {
+    std::vector<VectorType> points, queries;
+    generateData(nbPoints, 0, points, queries);
+
+    KdTreeType sequentialTree (points.size()), parallelTree (points.size());
+    for (const auto& p : points) {
+        sequentialTree.add(p);
+        parallelTree.add(p);
+    }
+
+    gr::Utils::Timer t;
+    t.reset();
+    sequentialTree.finalize(1);
+    const auto timestep = t.elapsed();
+    t.reset();
+    parallelTree.finalize(nbThreads);
+    const auto parallelTimestep = t.elapsed();
+
+#ifdef TRACE
+    std::cout << "Build timers (" << nbPoints << " points): \t 1 thread: "
+              << timestep.count()/1000
+              << "\t " << nbThreads << " threads: " << parallelTimestep.count()/1000 << std::endl;
+#else
+    void(timestep);
+    void(parallelTimestep);
+#endif
+
+    verifySameTree(sequentialTree, parallelTree);
+}
+
+/*!
+ * \brief Computes the k closest points to q within sqrt(sqdist) by brute
+ * force, skipping currentId, sorted by increasing distance
+ */
+std::vector<std::pair<float, int> >
+bruteForceKNearest(const std::vector<VectorType>& points, const VectorType& q,
+                   float sqdist, int k, int currentId) {
+    std::vector<std::pair<float, int> > neighbors;
+    for (unsigned int i = 0; i != points.size(); ++i) {
+        const float d = (points[i] - q).squaredNorm();
+        if (d <= sqdist && int(i) != currentId)
+            neighbors.emplace_back(d, i);
+    }
+    std::sort(neighbors.begin(), neighbors.end());
+    if (neighbors.size() > std::size_t(k))
+        neighbors.resize(k);
+    return neighbors;
+}
+
+/*!
+ * \brief Checks k nearest neighbors found by the tree against brute force.
+ * The ids are only compared when the distances are not tied.
+ */
+template <int k>
+void verifyKNearest(const std::vector<VectorType>& points, const VectorType& q,
+                    float sqdist, int currentId,
+                    const int* indices, const float* sqdists) {
+    const auto expected = bruteForceKNearest(points, q, sqdist, k, currentId);
+    for (int j = 0; j != k; ++j) {
+        if (j < int(expected.size())) {
+            VERIFY( sqdists[j] == expected[j].first );
+            VERIFY( indices[j] != currentId );
+            VERIFY( (points[indices[j]] - q).squaredNorm() == sqdists[j] );
+            const bool tied = (j > 0 && expected[j-1].first == expected[j].first) ||
+                              (j+1 < int(expected.size()) && expected[j+1].first == expected[j].first);
+            if (! tied)
+                VERIFY( indices[j] == expected[j].second );
+        } else {
+            VERIFY( indices[j] == KdTreeType::invalidIndex() );
+            VERIFY( sqdists[j] == sqdist );
+        }
+    }
+}
+
+/*!
+ * \brief Checks the k nearest neighbors queries, single and batched, against
+ * brute force
+ */
+template <int k>
+void testKNearest(unsigned int nbPoints, unsigned int nbQueries) {
+    std::vector<VectorType> points, queries;
+    generateData(nbPoints, nbQueries, points, queries);
+    KdTreeType tree = buildTree(points);
+
+    const float sqdist = 0.002f;
+    int   indices [k];
+    float sqdists [k];
+
+    for (unsigned int i = 0; i != nbQueries; ++i) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = queries[i];
+        query.sqdist = sqdist;
+        const int n = tree.doQueryKNearestIndices<k>(query, indices, sqdists);
+        VERIFY( n == int(bruteForceKNearest(points, queries[i], sqdist, k, -1).size()) );
+        verifyKNearest<k>(points, queries[i], sqdist, -1, indices, sqdists);
+    }
+
+    // the query points belong to the tree, and are excluded from the results
+    for (unsigned int i = 0; i < nbPoints; i += nbPoints / nbQueries) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = points[i];
+        query.sqdist = sqdist;
+        tree.doQueryKNearestIndices<k>(query, indices, sqdists, int(i));
+        verifyKNearest<k>(points, points[i], sqdist, int(i), indices, sqdists);
+    }
+
+    // batched queries, with and without Morton ordering, write the results of
+    // each query at its own position
+    std::vector<VectorType> batchPoints;
+    std::vector<int> currentIds;
+    for (unsigned int i = 0; i != nbQueries; ++i) {
+        if (i % 2) {
+            batchPoints.push_back(queries[i]);
+            currentIds.push_back(-1);
+        } else {
+            const int id = (i * 7919) % nbPoints;
+            batchPoints.push_back(points[id]);
+            currentIds.push_back(id);
+        }
+    }
+    for (bool mortonOrder : {false, true}) {
+        std::vector<int>   batchIndices (nbQueries * k);
+        std::vector<float> batchSqdists (nbQueries * k);
+        tree.doQueryKNearestIndicesBatch<k>(batchPoints.data(), nbQueries, sqdist,
+                                            batchIndices.data(), batchSqdists.data(),
+                                            currentIds.data(), mortonOrder);
+        for (unsigned int i = 0; i != nbQueries; ++i)
+            verifyKNearest<k>(points, batchPoints[i], sqdist, currentIds[i],
+                              batchIndices.data() + i*k, batchSqdists.data() + i*k);
+    }
+}
+
+/*!
+ * \brief Checks a tree with wide nodes, whose leaves store more points than
+ * the compact nodes allow, against brute force
+ */
+void testWideNodes(unsigned int nbPoints, unsigned int nbPointsPerCell, unsigned int nbQueries) {
+    typedef KdTree<double, std::int64_t> WideKdTreeType;
+    typedef WideKdTreeType::VectorType WideVectorType;
+    static_assert(std::is_same<WideKdTreeType::KdNode, WideKdTreeType::WideKdNode>::value,
+                  "64 bits indices use wide nodes");
+
+    std::vector<WideVectorType> points, queries;
+    for(unsigned int i = 0; i != nbPoints; i++)
+        points.push_back(WideVectorType::Random().normalized());
+    for(unsigned int i = 0; i != nbQueries; i++)
+        queries.push_back(WideVectorType::Random().normalized() + 0.01 * WideVectorType::Random());
+
+    WideKdTreeType tree (points.size(), nbPointsPerCell);
+    for (const auto& p : points)
+        tree.add(p);
+    tree.finalize();
+    VERIFY( tree.size() == nbPoints );
+
+    std::uint64_t largestLeaf = 0;
+    for (const auto& node : tree._getNodes())
+        if (node.leaf)
+            largestLeaf = std::max(largestLeaf, std::uint64_t(node.size));
+    VERIFY( largestLeaf > 65535 );
+
+    // the compact nodes cannot store such leaves
+    KdTreeType compactTree (points.size(), nbPointsPerCell);
+    for (const auto& p : points)
+        compactTree.add(p.cast<float>());
+    bool overflow = false;
+    try { compactTree.finalize(); }
+    catch (const std::length_error&) { overflow = true; }
+    VERIFY( overflow );
+
+    const double sqdist = 0.0005;
+    for (unsigned int i = 0; i != nbQueries; ++i) {
+        std::int64_t closestId = WideKdTreeType::invalidIndex();
+        double closestDist = sqdist;
+        std::vector<std::int64_t> expected;
+        for (unsigned int j = 0; j != nbPoints; ++j) {
+            const double d = (points[j] - queries[i]).squaredNorm();
+            if (d < sqdist)
+                expected.push_back(j);
+            if (d <= closestDist) {
+                closestDist = d;
+                closestId   = j;
+            }
+        }
+
+        WideKdTreeType::RangeQuery<> query;
+        query.queryPoint = queries[i];
+        query.sqdist = sqdist;
+        const auto closest = tree.doQueryRestrictedClosestIndex(query);
+        // the distances are summed in another order than squaredNorm()
+        VERIFY( closest.first == closestId );
+        VERIFY( std::abs(closest.second - closestDist) <= 1e-12 * sqdist );
+
+        std::vector<std::int64_t> ids;
+        tree.doQueryDistIndices(query, ids);
+        std::sort(ids.begin(), ids.end());
+        VERIFY( ids == expected );
+    }
+}
+
+//! Gives access to the layout of the snapshot header
+struct SnapshotLayout : public KdTreeType {
+    using KdTreeType::SnapshotHeader;
+};
+
+/*!
+ * \brief Finds the offset of array in data, looking at multiples of 64 bytes
+ * as done by the snapshots
+ */
+template <typename T>
+std::size_t findArray(const char* data, std::size_t size, const std::vector<T>& array) {
+    const std::size_t bytes = array.size() * sizeof(T);
+    for (std::size_t offset = 0; offset + bytes <= size; offset += 64)
+        if (std::memcmp(data + offset, array.data(), bytes) == 0)
+            return offset;
+    return size;
+}
+
+/*!
+ * \brief Saves a tree, loads it back and attaches it through a memory mapped
+ * file, and checks that incompatible or corrupted snapshots are rejected
+ */
+void testSnapshot(unsigned int nbPoints, unsigned int nbQueries) {
+    std::vector<VectorType> points, queries;
+    generateData(nbPoints, nbQueries, points, queries);
+    KdTreeType tree = buildTree(points);
+
+    const std::string filename = "kdtree_snapshot.bin";
+    VERIFY( tree.save(filename) );
+
+    KdTreeType loadedTree;
+    VERIFY( loadedTree.load(filename) );
+    verifySameTree(tree, loadedTree);
+
+    gr::Utils::MappedFile file (filename);
+    VERIFY( file.isOpen() );
+    KdTreeType attachedTree;
+    VERIFY( attachedTree.attach(file.data(), file.size()) );
+    VERIFY( attachedTree.size() == tree.size() );
+
+    const float sqdist = 0.001f;
+    for (const auto& q : queries) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = q;
+        query.sqdist = sqdist;
+        const auto closest = tree.doQueryRestrictedClosestIndex(query);
+        VERIFY( loadedTree.doQueryRestrictedClosestIndex(query) == closest );
+        VERIFY( attachedTree.doQueryRestrictedClosestIndex(query) == closest );
+
+        std::vector<int> ids, attachedIds;
+        tree.doQueryDistIndices(query, ids);
+        attachedTree.doQueryDistIndices(query, attachedIds);
+        VERIFY( ids == attachedIds );
+    }
+
+    // trees of another type reject the snapshot
+    KdTree<double> doubleTree;
+    VERIFY( ! doubleTree.attach(file.data(), file.size()) );
+    KdTree<float, std::int64_t> wideTree;
+    VERIFY( ! wideTree.attach(file.data(), file.size()) );
+
+    // truncated snapshots are rejected
+    KdTreeType otherTree;
+    VERIFY( ! otherTree.attach(file.data(), file.size() / 2) );
+    VERIFY( ! otherTree.attach(file.data(), 16) );
+
+    // corrupted nodes and indices are rejected
+    std::vector<std::uint64_t> buffer ((file.size() + 7) / 8);
+    char* data = reinterpret_cast<char*>(buffer.data());
+    std::memcpy(data, file.data(), file.size());
+    const std::size_t nodesOffset   = findArray(data, file.size(), tree._getNodes());
+    const std::size_t indicesOffset = findArray(data, file.size(), tree._getIndices());
+    VERIFY( nodesOffset < file.size() && indicesOffset < file.size() );
+    KdTreeType::KdNode* nodes = reinterpret_cast<KdTreeType::KdNode*>(data + nodesOffset);
+    int* indices = reinterpret_cast<int*>(data + indicesOffset);
+    VERIFY( otherTree.attach(data, file.size()) );
+
+    const KdTreeType::KdNode root = nodes[0];
+    nodes[0].firstChildId = tree._getNodes().size();
+    VERIFY( ! otherTree.attach(data, file.size()) );
+    nodes[0].firstChildId = 0;
+    VERIFY( ! otherTree.attach(data, file.size()) );
+    nodes[0] = root;
+
+    for (std::size_t i = 0; i != tree._getNodes().size(); ++i) {
+        if (! nodes[i].leaf) continue;
+        const KdTreeType::KdNode saved = nodes[i];
+        nodes[i].start = nbPoints - nodes[i].size + 1;
+        VERIFY( ! otherTree.attach(data, file.size()) );
+        nodes[i] = saved;
+        break;
+    }
+
+    const int savedIndex = indices[nbPoints / 2];
+    indices[nbPoints / 2] = nbPoints;
+    VERIFY( ! otherTree.attach(data, file.size()) );
+    indices[nbPoints / 2] = -1;
+    VERIFY( ! otherTree.attach(data, file.size()) );
+    indices[nbPoints / 2] = savedIndex;
+    VERIFY( otherTree.attach(data, file.size()) );
+
+    // depths overflowing the stack of the queries are rejected
+    std::uint32_t* maxDepth = reinterpret_cast<std::uint32_t*>(
+            data + offsetof(SnapshotLayout::SnapshotHeader, maxDepth));
+    const std::uint32_t savedMaxDepth = *maxDepth;
+    *maxDepth = KdTreeType::RangeQuery<>::stackSize;
+    VERIFY( ! otherTree.attach(data, file.size()) );
+    *maxDepth = KdTreeType::RangeQuery<>::stackSize - 1;
+    VERIFY( otherTree.attach(data, file.size()) );
+    *maxDepth = savedMaxDepth;
+
+    file.close();
+    std::remove(filename.c_str());
+}
+
+/*!
+ * \brief Inserts points in a DynamicKdTree, and checks its queries against a
+ * KdTree built on the points inserted so far
+ */
+void testDynamicTree(unsigned int bufferSize, unsigned int nbPoints, unsigned int nbQueries) {
+    typedef DynamicKdTree<float> DynamicKdTreeType;
+
+    std::vector<VectorType> points, queries;
+    generateData(nbPoints, nbQueries, points, queries);
+
+    DynamicKdTreeType dynamicTree (bufferSize);
+    const float sqdist = 0.005f;
+    const int k = 4;
+
+    // the queries are checked after several numbers of insertions, so that
+    // the points are spread in various levels and in the buffer
+    unsigned int inserted = 0;
+    for (unsigned int step : {bufferSize - 1, 1u, 3*bufferSize + 5, 4*bufferSize, nbPoints}) {
+        const unsigned int end = std::min(inserted + step, nbPoints);
+        for (; inserted != end; ++inserted)
+            dynamicTree.add(points[inserted]);
+        VERIFY( dynamicTree.size() == inserted );
+
+        const std::vector<VectorType> subset (points.begin(), points.begin() + inserted);
+        const KdTreeType tree = buildTree(subset);
+
+        for (unsigned int i = 0; i != nbQueries; ++i) {
+            // alternate queries off the points, and points of the tree
+            const bool inTree = i % 2 == 0;
+            const int currentId = inTree ? int((i * 7919) % inserted) : -1;
+            const VectorType q = inTree ? subset[currentId] : queries[i];
+
+            KdTreeType::RangeQuery<> query;
+            query.queryPoint = q;
+            query.sqdist = sqdist;
+
+            std::vector<int> ids, dynamicIds;
+            tree.doQueryDistIndices(query, ids);
+            dynamicTree.doQueryDistIndices(query, dynamicIds);
+            std::sort(ids.begin(), ids.end());
+            std::sort(dynamicIds.begin(), dynamicIds.end());
+            VERIFY( ids == dynamicIds );
+
+            const auto closest = tree.doQueryRestrictedClosestIndex(query, currentId);
+            const auto dynamicClosest = dynamicTree.doQueryRestrictedClosestIndex(query, currentId);
+            VERIFY( dynamicClosest.second == closest.second );
+            VERIFY( dynamicClosest.first != currentId || currentId == -1 );
+            if (closest.first != KdTreeType::invalidIndex())
+                VERIFY( (subset[dynamicClosest.first] - q).squaredNorm() == closest.second );
+            else
+                VERIFY( dynamicClosest.first == KdTreeType::invalidIndex() );
+
+            int   indices [k], dynamicIndices [k];
+            float sqdists [k], dynamicSqdists [k];
+            const int n = tree.doQueryKNearestIndices<k>(query, indices, sqdists, currentId);
+            VERIFY( dynamicTree.doQueryKNearestIndices<k>(query, dynamicIndices, dynamicSqdists, currentId) == n );
+            VERIFY( std::equal(sqdists, sqdists + k, dynamicSqdists) );
+            for (int j = 0; j != n; ++j) {
+                VERIFY( dynamicIndices[j] != currentId );
+                VERIFY( (subset[dynamicIndices[j]] - q).squaredNorm() == dynamicSqdists[j] );
+            }
+        }
+    }
+}
+
+/*!
+ * \brief Checks that a tree with nodes stored in van Emde Boas order gives the
+ * same results as the default layout, and compares the query timings
+ */
+void testRelayout(unsigned int nbPoints, unsigned int nbQueries) {
+    std::vector<VectorType> points, queries;
+    generateData(nbPoints, nbQueries, points, queries);
+
+    KdTreeType tree = buildTree(points);
+    KdTreeType vebTree = tree;
+    vebTree.relayout();
+
+    const float sqdist = 0.001f;
+    std::vector<std::pair<int, float> > closest (nbQueries), vebClosest (nbQueries);
+    gr::Utils::Timer t;
+
+    t.reset();
+    for (unsigned int i = 0; i != nbQueries; ++i) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = queries[i];
+        query.sqdist = sqdist;
+        closest[i] = tree.doQueryRestrictedClosestIndex(query);
+    }
+    const auto timestep = t.elapsed();
+
+    t.reset();
+    for (unsigned int i = 0; i != nbQueries; ++i) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = queries[i];
+        query.sqdist = sqdist;
+        vebClosest[i] = vebTree.doQueryRestrictedClosestIndex(query);
+    }
+    const auto vebTimestep = t.elapsed();
+
+#ifdef TRACE
+    std::cout << "Timers (" << nbPoints << " points): \t Default layout: "
+              << timestep.count()/1000
+              << "\t van Emde Boas layout: " << vebTimestep.count()/1000 << std::endl;
+#else
+    void(timestep);
+    void(vebTimestep);
+#endif
+
+    VERIFY( closest == vebClosest );
+
+    // range queries return the same points in the same order
+    for (unsigned int i = 0; i != nbQueries; i += 10) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = queries[i];
+        query.sqdist = 10.f * sqdist;
+        std::vector<int> ids, vebIds;
+        tree.doQueryDistIndices(query, ids);
+        vebTree.doQueryDistIndices(query, vebIds);
+        VERIFY( ids == vebIds );
+    }
+}
+
+/*!
+ * \brief Checks the first hit and approximate queries against the exact
+ * closest point query
+ */
+void testApproximateQueries(unsigned int nbPoints, unsigned int nbQueries) {
+    std::vector<VectorType> points, queries;
+    generateData(nbPoints, nbQueries, points, queries);
+
+    KdTreeType tree = buildTree(points);
+
+    const float sqdist  = 0.001f;
+    const float epsilon = 0.5f;
+    for (unsigned int i = 0; i != nbQueries; ++i) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = queries[i];
+        query.sqdist = sqdist;
+        const auto closest = tree.doQueryRestrictedClosestIndex(query);
+        const auto approx  = tree.doQueryRestrictedClosestIndex(query, -1, epsilon);
+        const int  hit     = tree.doQueryFirstHitIndex(query);
+
+        VERIFY( (closest.first == KdTreeType::invalidIndex()) ==
+                (hit == KdTreeType::invalidIndex()) );
+        VERIFY( (closest.first == KdTreeType::invalidIndex()) ==
+                (approx.first == KdTreeType::invalidIndex()) );
+        if (hit != KdTreeType::invalidIndex()) {
+            VERIFY( (points[hit] - queries[i]).squaredNorm() <= sqdist );
+            VERIFY( approx.second <= (1.f + epsilon) * (1.f + epsilon) * closest.second );
+        }
+    }
+}
+
+/*!
+ * \brief Checks that the calibration selects one of the candidate leaf sizes,
+ * and that the calibrated tree gives the same results
+ */
+void testCalibration(unsigned int nbPoints) {
+    std::vector<VectorType> points, queries;
+    generateData(nbPoints, 1000, points, queries);
+
+    const float sqdist = 0.001f;
+    const std::vector<unsigned int> leafSizes = {8, 32, 128};
+    const auto parameters = KdTreeType::calibrate(points, sqdist, 1000, leafSizes);
+    VERIFY( std::find(leafSizes.begin(), leafSizes.end(), parameters.nofPointsPerCell)
+            != leafSizes.end() );
+
+    KdTreeType tree = buildTree(points);
+    KdTreeType calibratedTree (points.size(), parameters);
+    for (const auto& p : points)
+        calibratedTree.add(p);
+    calibratedTree.finalize();
+    VERIFY( calibratedTree.buildParameters().nofPointsPerCell == parameters.nofPointsPerCell );
+
+#ifdef TRACE
+    std::cout << "Calibrated leaf size (" << nbPoints << " points): "
+              << parameters.nofPointsPerCell << std::endl;
+#endif
+
+    for (const auto& q : queries) {
+        KdTreeType::RangeQuery<> query;
+        query.queryPoint = q;
+        query.sqdist = sqdist;
+        VERIFY( tree.doQueryRestrictedClosestIndex(query).second ==
+                calibratedTree.doQueryRestrictedClosestIndex(query).second );
+    }
+}
+
+
+int main(int argc, const char **argv) {
+    if(!Testing::init_testing(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    using std::cout;
+    using std::endl;
+
+    cout << "Point storage..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testPointStorage(10000, 1000) ));
+    }
+    cout << "Ok..." << endl;
+
+    cout << "Parallel construction..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testParallelBuild(4*KD_PARALLEL_BUILD_SIZE, 4) ));
+        CALL_SUBTEST(( testParallelBuild(1000000, 4) ));
+    }
+    cout << "Ok..." << endl;
+
+    cout << "K nearest neighbors..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testKNearest<1>(10000, 1000) ));
+        CALL_SUBTEST(( testKNearest<4>(10000, 1000) ));
+        CALL_SUBTEST(( testKNearest<16>(10000, 1000) ));
+    }
+    cout << "Ok..." << endl;
+
+    cout << "Wide nodes..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testWideNodes(150000, 100000, 200) ));
+    }
+    cout << "Ok..." << endl;
+
+    cout << "Snapshots..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testSnapshot(10000, 1000) ));
+    }
+    cout << "Ok..." << endl;
+
+    cout << "Dynamic tree..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testDynamicTree(64, 2000, 200) ));
+        CALL_SUBTEST(( testDynamicTree(KD_DYNAMIC_BUFFER_SIZE, 20000, 200) ));
+    }
+    cout << "Ok..." << endl;
+
+    cout << "Relayout nodes in van Emde Boas order..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testRelayout(10000, 10000) ));
+        CALL_SUBTEST(( testRelayout(1000000, 100000) ));
+    }
+    cout << "Ok..." << endl;
+
+    cout << "Approximate and first hit queries..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testApproximateQueries(10000, 10000) ));
+    }
+    cout << "Ok..." << endl;
+
+    cout << "Calibrate the leaf size..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testCalibration(100000) ));
+    }
+    cout << "Ok..." << endl;
+
+    return EXIT_SUCCESS;
+}
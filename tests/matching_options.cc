@@ -0,0 +1,510 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// This test checks the options of the congruent set exploration on synthetic
+// data: each option must give the same registration as the default path, or
+// one at least as good.
+
+#include "gr/algorithms/match4pcsBase.h"
+#include "gr/algorithms/FunctorSuper4pcs.h"
+#include "gr/algorithms/match3pcs.h"
+#include "gr/algorithms/PointPairFilter.h"
+#include "gr/accelerators/kdtree.h"
+#include "gr/accelerators/occupancyGrid.h"
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "testing.h"
+
+using namespace gr;
+
+using Scalar     = Point3D::Scalar;
+using VectorType = Point3D::VectorType;
+using MatrixType = Eigen::Matrix<Scalar, 4, 4>;
+
+struct TrVisitorType {
+    template <typename Derived>
+    inline void operator() (float, float, const Eigen::MatrixBase<Derived>&) {}
+    constexpr bool needsGlobalTransformation() const { return false; }
+};
+
+//! Visitor recording the number of trials each time the progress is reported
+struct TrialsVisitorType {
+    const int* numberOfTrials = nullptr;
+    std::vector<int> history;
+
+    template <typename Derived>
+    inline void operator() (float, float, const Eigen::MatrixBase<Derived>&)
+    { history.push_back(*numberOfTrials); }
+    constexpr bool needsGlobalTransformation() const { return false; }
+};
+
+Utils::Logger logger(Utils::NoLog);
+
+//! Matcher providing access to the state retained by the exploration
+template <class _MatcherType>
+class OptionsTestMatcher : public _MatcherType {
+public:
+    using MatcherType       = _MatcherType;
+    using CongruentBaseType = typename MatcherType::CongruentBaseType;
+
+    using MatcherType::MatcherType;
+
+    inline Scalar bestLCP() const { return MatcherType::best_LCP_; }
+    inline const MatrixType& transform() const { return MatcherType::transform_; }
+    inline const CongruentBaseType& base() const { return MatcherType::base_; }
+    inline const int& numberOfTrials() const { return MatcherType::number_of_trials_; }
+
+    /// LCP of mat computed without early termination
+    inline Scalar verify(const MatrixType& mat) const
+    { return MatcherType::Verify(mat, Scalar(0)); }
+};
+
+using Matcher4pcs = OptionsTestMatcher<Match4pcsBase<FunctorSuper4PCS, TrVisitorType,
+                                                     AdaptivePointFilter,
+                                                     AdaptivePointFilter::Options> >;
+using TrialsMatcher4pcs = OptionsTestMatcher<Match4pcsBase<FunctorSuper4PCS, TrialsVisitorType,
+                                                           AdaptivePointFilter,
+                                                           AdaptivePointFilter::Options> >;
+using Matcher3pcs = OptionsTestMatcher<Match3pcs<TrVisitorType,
+                                                 AdaptivePointFilter,
+                                                 AdaptivePointFilter::Options> >;
+
+constexpr Scalar kDelta = Scalar(0.05);
+/// Largest distance between a point of Q moved by the computed transformation
+/// and by the ground truth, for the registration to be considered correct
+constexpr Scalar kMaxError = Scalar(2) * kDelta;
+
+/*!
+ * \brief Generates a bumpy surface P, and Q as a part of P moved by the rigid
+ * transformation groundTruth^-1.
+ */
+void generateClouds(unsigned int nbPoints, unsigned int seed,
+                    std::vector<Point3D>& P, std::vector<Point3D>& Q,
+                    MatrixType& groundTruth) {
+    std::mt19937 generator (seed);
+    std::uniform_real_distribution<Scalar> uniform (-1, 1);
+
+    Eigen::Transform<Scalar, 3, Eigen::Affine> motion (
+            Eigen::AngleAxis<Scalar>(Scalar(0.4) + Scalar(0.3) * uniform(generator),
+                                     VectorType(uniform(generator), uniform(generator), 1).normalized()));
+    motion.pretranslate(VectorType(uniform(generator), uniform(generator), uniform(generator)));
+    groundTruth = motion.matrix().inverse();
+
+    P.clear();
+    Q.clear();
+    for (unsigned int i = 0; i != nbPoints; ++i) {
+        const Scalar x = uniform(generator), y = uniform(generator);
+        Point3D p (x, y, Scalar(0.3) * std::sin(3*x) * std::cos(2*y) + Scalar(0.2) * x * y);
+        p.set_normal(VectorType(Scalar(-0.9) * std::cos(3*x) * std::cos(2*y) - Scalar(0.2) * y,
+                                Scalar( 0.6) * std::sin(3*x) * std::sin(2*y) - Scalar(0.2) * x,
+                                1));
+        P.push_back(p);
+
+        // partial overlap
+        if (x < Scalar(-0.4)) continue;
+        Point3D q (VectorType(motion * p.pos()));
+        q.set_normal(motion.linear() * p.normal());
+        Q.push_back(q);
+    }
+}
+
+/// Options used to register the clouds of generateClouds
+template <typename MatcherType>
+typename MatcherType::OptionsType makeOptions() {
+    typename MatcherType::OptionsType options;
+    VERIFY(options.configureOverlap(Scalar(0.6)));
+    options.delta       = kDelta;
+    options.sample_size = 200;
+    return options;
+}
+
+/*!
+ * \brief Largest distance between the points of Q moved by mat and by the
+ * ground truth
+ */
+Scalar registrationError(const MatrixType& mat, const std::vector<Point3D>& Q,
+                         const MatrixType& groundTruth) {
+    Scalar error = 0;
+    for (const auto& q : Q) {
+        const Eigen::Matrix<Scalar, 4, 1> p = q.pos().homogeneous();
+        error = std::max(error, ((mat - groundTruth) * p).norm());
+    }
+    return error;
+}
+
+/*!
+ * \brief Registers Q on P, and checks the result against the ground truth
+ */
+template <typename MatcherType>
+Scalar registerClouds(MatcherType& matcher,
+                      const std::vector<Point3D>& P, const std::vector<Point3D>& Q,
+                      const MatrixType& groundTruth, MatrixType& mat) {
+    UniformDistSampler sampler;
+    TrVisitorType visitor;
+    mat = MatrixType::Identity();
+    const Scalar lcp = matcher.ComputeTransformation(P, Q, mat, sampler, visitor);
+    VERIFY(registrationError(mat, Q, groundTruth) < kMaxError);
+    return lcp;
+}
+
+/*!
+ * \brief Builds an occupancy grid on random points, and checks the
+ * classification of random queries against exact kd-tree queries
+ */
+void testOccupancyGrid(unsigned int nbPoints, unsigned int nbQueries) {
+    using Grid = OccupancyGrid<Scalar>;
+    using RangeQuery = KdTree<Scalar>::RangeQuery<>;
+
+    std::vector<Point3D> points;
+    for (unsigned int i = 0; i != nbPoints; ++i)
+        points.emplace_back(VectorType(VectorType::Random()));
+
+    Grid grid;
+    grid.build(points, kDelta);
+    VERIFY(! grid.empty());
+
+    KdTree<Scalar> tree (points.size());
+    for (const auto& p : points)
+        tree.add(p.pos());
+    tree.finalize();
+
+    // queries close to the points, to get cells of each state
+    size_t count [3] = {0, 0, 0};
+    for (unsigned int i = 0; i != nbQueries; ++i) {
+        const VectorType q = points[std::rand() % nbPoints].pos()
+                + Scalar(3) * kDelta * VectorType::Random();
+
+        RangeQuery query;
+        query.queryPoint = q;
+        query.sqdist     = kDelta * kDelta;
+        const bool found = tree.doQueryFirstHitIndex(query) != KdTree<Scalar>::invalidIndex();
+
+        const Grid::CellState state = grid.classify(q);
+        count[state]++;
+        if (state == Grid::FULL)  VERIFY(found);
+        if (state == Grid::EMPTY) VERIFY(! found);
+    }
+    VERIFY(count[Grid::EMPTY] > 0 && count[Grid::BORDER] > 0 && count[Grid::FULL] > 0);
+}
+
+/*!
+ * \brief Checks that the LCP computed with the occupancy grid is the one
+ * computed with the kd-tree only
+ */
+void testOccupancyGridVerify(unsigned int nbPoints, unsigned int seed) {
+    std::vector<Point3D> P, Q;
+    MatrixType groundTruth;
+    generateClouds(nbPoints, seed, P, Q, groundTruth);
+
+    const auto options = makeOptions<Matcher4pcs>();
+    auto gridOptions = options;
+    gridOptions.use_occupancy_grid = true;
+
+    Matcher4pcs matcher (options, logger), gridMatcher (gridOptions, logger);
+    MatrixType mat, gridMat;
+    const Scalar lcp     = registerClouds(matcher, P, Q, groundTruth, mat);
+    const Scalar gridLcp = registerClouds(gridMatcher, P, Q, groundTruth, gridMat);
+    VERIFY(lcp == gridLcp);
+    VERIFY(mat.isApprox(gridMat));
+
+    // the transformation found, and transformations around it
+    for (int i = 0; i != 100; ++i) {
+        MatrixType candidate = matcher.transform();
+        if (i != 0) {
+            const Eigen::AngleAxis<Scalar> rotation (Scalar(0.1) * Scalar(std::rand()) / Scalar(RAND_MAX),
+                                                     VectorType(VectorType::Random()).normalized());
+            candidate.topLeftCorner<3,3>() = rotation * candidate.topLeftCorner<3,3>();
+            candidate.block<3,1>(0,3) += Scalar(2) * kDelta * VectorType::Random();
+        }
+        VERIFY(matcher.verify(candidate) == gridMatcher.verify(candidate));
+    }
+}
+
+/*!
+ * \brief Checks that the registration converges when the verifications are
+ * stopped by the SPRT
+ */
+void testSprt(unsigned int nbPoints, unsigned int seed) {
+    std::vector<Point3D> P, Q;
+    MatrixType groundTruth;
+    generateClouds(nbPoints, seed, P, Q, groundTruth);
+
+    auto options = makeOptions<Matcher4pcs>();
+    options.use_sprt_verification = true;
+
+    Matcher4pcs matcher (options, logger);
+    MatrixType mat;
+    const Scalar lcp = registerClouds(matcher, P, Q, groundTruth, mat);
+
+    // A transformation rejected by the SPRT has a partial LCP lower than the
+    // best LCP, so the retained transformation has been fully verified.
+    VERIFY(lcp == matcher.bestLCP());
+    VERIFY(lcp == matcher.verify(matcher.transform()));
+}
+
+/*!
+ * \brief Checks that the transformations found several times are read from
+ * the transformation cache, without changing the registration
+ */
+void testTransformationCache(unsigned int nbPoints, unsigned int seed) {
+    std::vector<Point3D> P, Q;
+    MatrixType groundTruth;
+    generateClouds(nbPoints, seed, P, Q, groundTruth);
+
+    const auto options = makeOptions<Matcher4pcs>();
+    auto cacheOptions = options;
+    cacheOptions.use_transformation_cache = true;
+
+    Matcher4pcs matcher (options, logger), cacheMatcher (cacheOptions, logger);
+    MatrixType mat, cacheMat;
+    const Scalar lcp      = registerClouds(matcher, P, Q, groundTruth, mat);
+    const Scalar cacheLcp = registerClouds(cacheMatcher, P, Q, groundTruth, cacheMat);
+
+    VERIFY(matcher.getTransformationCacheHits()   == 0);
+    VERIFY(matcher.getTransformationCacheMisses() == 0);
+    VERIFY(cacheMatcher.getTransformationCacheHits()   > 0);
+    VERIFY(cacheMatcher.getTransformationCacheMisses() > 0);
+    // a cached LCP is reused for the transformations of the same cell, which
+    // may slightly differ from the retained one
+    VERIFY(std::abs(lcp - cacheLcp) <= Scalar(0.05));
+}
+
+/*!
+ * \brief Checks that the trials run in parallel converge to the registration
+ * found by the sequential trials
+ */
+void testParallelTrials(unsigned int nbPoints, unsigned int seed, int nbThreads) {
+    std::vector<Point3D> P, Q;
+    MatrixType groundTruth;
+    generateClouds(nbPoints, seed, P, Q, groundTruth);
+
+    const auto options = makeOptions<Matcher4pcs>();
+    auto parallelOptions = options;
+    parallelOptions.nthread_trials = nbThreads;
+
+    Matcher4pcs matcher (options, logger), parallelMatcher (parallelOptions, logger);
+    MatrixType mat, parallelMat;
+    const Scalar lcp         = registerClouds(matcher, P, Q, groundTruth, mat);
+    const Scalar parallelLcp = registerClouds(parallelMatcher, P, Q, groundTruth, parallelMat);
+
+    // both registrations are checked against the ground truth, the parallel
+    // trials exploring other bases than the sequential ones
+    VERIFY(std::abs(lcp - parallelLcp) <= Scalar(0.05));
+}
+
+/*!
+ * \brief Checks that the deterministic trials retain the same registration
+ * whatever the number of threads running them
+ */
+template <typename MatcherType>
+void testDeterministicTrials(unsigned int nbPoints, unsigned int seed) {
+    std::vector<Point3D> P, Q;
+    MatrixType groundTruth;
+    generateClouds(nbPoints, seed, P, Q, groundTruth);
+
+    auto options = makeOptions<MatcherType>();
+    options.deterministic_trials = true;
+
+    Scalar refLcp = 0;
+    MatrixType refTransform;
+    typename MatcherType::CongruentBaseType refBase;
+    for (int nbThreads : {1, 2, 4}) {
+        options.nthread_trials = nbThreads;
+        MatcherType matcher (options, logger);
+        UniformDistSampler sampler;
+        TrVisitorType visitor;
+        MatrixType mat = MatrixType::Identity();
+        matcher.ComputeTransformation(P, Q, mat, sampler, visitor);
+
+        if (nbThreads == 1) {
+            refLcp       = matcher.bestLCP();
+            refTransform = matcher.transform();
+            refBase      = matcher.base();
+        } else {
+            VERIFY(matcher.bestLCP() == refLcp);
+            VERIFY(matcher.transform() == refTransform);
+            VERIFY(matcher.base() == refBase);
+        }
+    }
+}
+
+/*!
+ * \brief Checks that the registration stops promptly when the cancellation is
+ * requested or when the time budget is exhausted, with a valid partial result
+ */
+void testDeadline(unsigned int nbPoints, unsigned int seed, int nbThreads) {
+    std::vector<Point3D> P, Q;
+    MatrixType groundTruth;
+    generateClouds(nbPoints, seed, P, Q, groundTruth);
+
+    const std::atomic<bool> cancelled (true);
+    auto cancelledOptions = makeOptions<Matcher4pcs>();
+    cancelledOptions.nthread_trials     = nbThreads;
+    cancelledOptions.cancellation_token = &cancelled;
+    auto budgetOptions = makeOptions<Matcher4pcs>();
+    budgetOptions.nthread_trials = nbThreads;
+    budgetOptions.max_time       = std::chrono::milliseconds(1);
+
+    for (const auto& options : {cancelledOptions, budgetOptions}) {
+        Matcher4pcs matcher (options, logger);
+        UniformDistSampler sampler;
+        TrVisitorType visitor;
+        MatrixType mat = MatrixType::Identity();
+
+        const auto start = std::chrono::steady_clock::now();
+        const Scalar lcp = matcher.ComputeTransformation(P, Q, mat, sampler, visitor);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        VERIFY(elapsed < std::chrono::milliseconds(500));
+        VERIFY(lcp >= Scalar(0) && lcp <= Scalar(1));
+        VERIFY(lcp == matcher.bestLCP());
+        VERIFY(mat.allFinite());
+    }
+}
+
+/*!
+ * \brief Checks that the adaptive trials reduce the number of trials during
+ * the exploration, and never increase it above the initial estimation
+ */
+void testAdaptiveTrials(unsigned int nbPoints, unsigned int seed) {
+    std::vector<Point3D> P, Q;
+    MatrixType groundTruth;
+    generateClouds(nbPoints, seed, P, Q, groundTruth);
+
+    for (bool adaptive : {false, true}) {
+        auto options = makeOptions<TrialsMatcher4pcs>();
+        options.use_adaptive_trials = adaptive;
+        TrialsMatcher4pcs matcher (options, logger);
+        UniformDistSampler sampler;
+        TrialsVisitorType visitor;
+        visitor.numberOfTrials = &matcher.numberOfTrials();
+        MatrixType mat = MatrixType::Identity();
+        matcher.ComputeTransformation(P, Q, mat, sampler, visitor);
+
+        // the first report gives the initial estimation
+        const std::vector<int>& history = visitor.history;
+        VERIFY(history.size() > 1);
+        for (std::size_t i = 1; i != history.size(); ++i)
+            VERIFY(adaptive ? history[i] <= history[i-1] : history[i] == history[0]);
+        if (adaptive)
+            VERIFY(history.back() < history.front());
+    }
+}
+
+/*!
+ * \brief Checks that registering Q on a prepared target gives the same
+ * registration as registering it on the raw P, and that the calibrated kd-tree
+ * parameters are reported
+ */
+void testPreparedTarget(unsigned int nbPoints, unsigned int seed) {
+    std::vector<Point3D> P, Q;
+    MatrixType groundTruth;
+    generateClouds(nbPoints, seed, P, Q, groundTruth);
+
+    for (bool grid : {false, true}) {
+        auto options = makeOptions<Matcher4pcs>();
+        options.use_occupancy_grid = grid;
+
+        Matcher4pcs matcher (options, logger);
+        MatrixType mat;
+        const Scalar lcp = registerClouds(matcher, P, Q, groundTruth, mat);
+
+        UniformDistSampler sampler;
+        TrVisitorType visitor;
+        const PreparedTarget target (P, sampler, options);
+        Matcher4pcs preparedMatcher (options, logger);
+        MatrixType preparedMat = MatrixType::Identity();
+        const Scalar preparedLcp =
+                preparedMatcher.ComputeTransformation(target, Q, preparedMat, sampler, visitor);
+
+        VERIFY(preparedLcp == lcp);
+        VERIFY(preparedMatcher.transform() == matcher.transform());
+        VERIFY(preparedMat == mat);
+    }
+
+    // the leaf size of the kd-tree is selected when requested, and used by
+    // the matchers given the target
+    auto options = makeOptions<Matcher4pcs>();
+    UniformDistSampler sampler;
+    VERIFY(! PreparedTarget(P, sampler, options).kdTreeCalibrated());
+    options.calibrate_kdtree = true;
+    const PreparedTarget target (P, sampler, options);
+    VERIFY(target.kdTreeCalibrated());
+
+    Matcher4pcs matcher (options, logger);
+    TrVisitorType visitor;
+    MatrixType mat = MatrixType::Identity();
+    matcher.ComputeTransformation(target, Q, mat, sampler, visitor);
+    VERIFY(matcher.getKdTreeParameters().nofPointsPerCell ==
+           target.kdTreeParameters().nofPointsPerCell);
+}
+
+int main(int argc, const char **argv) {
+    if(!Testing::init_testing(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    using std::cout;
+    using std::endl;
+
+    cout << "Occupancy grid..." << endl;
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testOccupancyGrid(10000, 100000) ));
+    }
+    CALL_SUBTEST(( testOccupancyGridVerify(2000, Testing::g_seed) ));
+    cout << "Ok..." << endl;
+
+    cout << "SPRT verification..." << endl;
+    CALL_SUBTEST(( testSprt(2000, Testing::g_seed) ));
+    cout << "Ok..." << endl;
+
+    cout << "Transformation cache..." << endl;
+    CALL_SUBTEST(( testTransformationCache(2000, Testing::g_seed) ));
+    cout << "Ok..." << endl;
+
+    cout << "Parallel trials..." << endl;
+    CALL_SUBTEST(( testParallelTrials(2000, Testing::g_seed, 4) ));
+    cout << "Ok..." << endl;
+
+    cout << "Deterministic trials..." << endl;
+    CALL_SUBTEST(( testDeterministicTrials<Matcher4pcs>(2000, Testing::g_seed) ));
+    CALL_SUBTEST(( testDeterministicTrials<Matcher3pcs>(2000, Testing::g_seed) ));
+    cout << "Ok..." << endl;
+
+    cout << "Deadline and cancellation..." << endl;
+    CALL_SUBTEST(( testDeadline(2000, Testing::g_seed, 1) ));
+    CALL_SUBTEST(( testDeadline(2000, Testing::g_seed, 4) ));
+    cout << "Ok..." << endl;
+
+    cout << "Adaptive trials..." << endl;
+    CALL_SUBTEST(( testAdaptiveTrials(2000, Testing::g_seed) ));
+    cout << "Ok..." << endl;
+
+    cout << "Prepared target..." << endl;
+    CALL_SUBTEST(( testPreparedTarget(2000, Testing::g_seed) ));
+    cout << "Ok..." << endl;
+
+    return EXIT_SUCCESS;
+}
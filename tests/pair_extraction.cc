@@ -254,6 +254,73 @@ void callSubTests()
     }
 }
 
+/*!
+ * \brief Generate a set of random points, and compare the pairs extracted by
+   the dual tree traversal with the brute force extraction
+ */
+template<typename Scalar, int Dim>
+void testDualTree( Scalar r, Scalar epsilon, unsigned int nbPoints ){
+  using namespace gr::Accelerators::PairExtraction;
+
+  typedef Eigen::Matrix<Scalar, Dim, 1> Point;
+  typedef HyperSphere< Point, Dim, Scalar > Sphere;
+  typedef IntersectionFunctor<Sphere, Point, Dim, Scalar> Functor;
+
+  gr::Utils::Timer t;
+  MyPairCreationFunctor functor;
+  std::vector< std::pair<unsigned int, unsigned int> > p2;
+
+  std::vector<Point> points;
+  Point half (Point::Ones()/2.f);
+  for(unsigned int i = 0; i != nbPoints; i++)
+    points.push_back(0.5f*Point::Random().normalized() + half);
+
+  typename Functor::Tree tree;
+  tree.build(points);
+
+  t.reset();
+  Functor().processDualTree(tree, r, epsilon, functor);
+#ifdef TRACE
+  const auto DTtimestep = t.elapsed();
+#endif
+
+  t.reset();
+  for(unsigned int i = 0; i != nbPoints; i++)
+    for(unsigned int j = i+1; j < nbPoints; j++)
+      if (Sphere::intersectPoint(points[i], epsilon, points[j], r))
+        p2.emplace_back(i,j);
+
+#ifdef TRACE
+  const auto BFtimestep = t.elapsed();
+  std::cout << "Timers (" << (DTtimestep.count() < BFtimestep.count()
+                              ? "PASSED" : "NOT PASSED")
+            << "): \t Dual tree: " << DTtimestep.count()/1000
+            << "\t BruteForce: " << BFtimestep.count()/1000 << std::endl;
+#endif
+
+  std::sort(functor.pairs.begin(), functor.pairs.end());
+  std::sort(p2.begin(), p2.end());
+
+  VERIFY( functor.pairs.size() == p2.size() );
+  VERIFY( std::equal(functor.pairs.begin(), functor.pairs.end(), p2.begin()));
+}
+
+template<typename Scalar, int Dim>
+void callDualTreeSubTests()
+{
+    using namespace gr::Accelerators::PairExtraction;
+
+    Scalar   r = 0.5; // radius of the spheres
+    Scalar eps = GetRoundedEpsilonValue(0.125/16.); // epsilon value
+
+#pragma omp parallel for
+    for(int i = 0; i < Testing::g_repeat; ++i)
+    {
+        CALL_SUBTEST(( testDualTree<Scalar, Dim>(r, eps, 2500) ));
+        CALL_SUBTEST(( testDualTree<Scalar, Dim>(r/4, eps, 5000) ));
+    }
+}
+
 template <template <typename, typename> typename FunctorType>
 void callMatch4SubTestsWithFunctor()
 {
@@ -315,8 +382,47 @@ void callMatch4SubTestsWithFunctor()
                            3,
                            &pairs2);
 
+        // both pair sets extracted at once, in the same order
+        std::vector<std::pair<int, int>> multiPairs1, multiPairs2;
+        const std::array<PairExtractionQuery, 2> queries {{
+            { distance1, normal_angle1, 0, 1, &multiPairs1 },
+            { distance2, normal_angle2, 2, 3, &multiPairs2 } }};
+        match.getFunctor().ExtractPairs(queries, pair_distance_epsilon);
+        VERIFY( multiPairs1 == pairs1 );
+        VERIFY( multiPairs2 == pairs2 );
+
+        // the pairs extracted by several threads are the same, in the same order
+        OptionType mtOpt = opt;
+        mtOpt.nthread_pairs = 4;
+        Testing::TestMatcher<MatcherType> mtMatch (mtOpt, logger);
+        mtMatch.init(P, Q, sampler);
+
+        std::vector<std::pair<int, int>> mtPairs1, mtPairs2;
+        const std::array<PairExtractionQuery, 2> mtQueries {{
+            { distance1, normal_angle1, 0, 1, &mtPairs1 },
+            { distance2, normal_angle2, 2, 3, &mtPairs2 } }};
+        mtMatch.getFunctor().ExtractPairs(mtQueries, pair_distance_epsilon);
+        VERIFY( mtPairs1 == pairs1 );
+        VERIFY( mtPairs2 == pairs2 );
+
+        // the pairs read from the distance index are the same, in any order
+        OptionType indexOpt = opt;
+        indexOpt.use_pair_index = true;
+        Testing::TestMatcher<MatcherType> indexMatch (indexOpt, logger);
+        indexMatch.init(P, Q, sampler);
+
+        std::vector<std::pair<int, int>> indexPairs1, indexPairs2;
+        const std::array<PairExtractionQuery, 2> indexQueries {{
+            { distance1, normal_angle1, 0, 1, &indexPairs1 },
+            { distance2, normal_angle2, 2, 3, &indexPairs2 } }};
+        indexMatch.getFunctor().ExtractPairs(indexQueries, pair_distance_epsilon);
+
         std::sort(pairs1.begin(), pairs1.end());
         std::sort(pairs2.begin(), pairs2.end());
+        std::sort(indexPairs1.begin(), indexPairs1.end());
+        std::sort(indexPairs2.begin(), indexPairs2.end());
+        VERIFY( indexPairs1 == pairs1 );
+        VERIFY( indexPairs2 == pairs2 );
 
 #ifdef TRACE
 
@@ -406,6 +512,13 @@ int main(int argc, const char **argv) {
     callSubTests<long double, 4, IntersectionFunctor>();
     cout << "Ok..." << endl;
 
+    cout << "Extract pairs in 2, 3 and 4 dimensions (DUAL TREE)..." << endl;
+    callDualTreeSubTests<float, 2>();
+    callDualTreeSubTests<double, 3>();
+    callDualTreeSubTests<float, 3>();
+    callDualTreeSubTests<double, 4>();
+    cout << "Ok..." << endl;
+
     callMatch4SubTests();
 
     return EXIT_SUCCESS;